@@ -0,0 +1,544 @@
+#include "AssetCache.h"
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "WAVFileReader.h"
+
+static const char *TAG = "CACHE";
+
+// bump when the layout of cached files changes so old ones get rebuilt
+static const uint16_t CACHE_VERSION = 2;
+// frames read and written per step of a transcode
+static const int INGEST_CHUNK_FRAMES = 256;
+// biggest source frame we transcode - 2 channels of 32 bits
+static const int MAX_SOURCE_FRAME_BYTES = 8;
+// smpl chunk with a single loop
+static const int SMPL_SIZE = 60;
+// transcodes are written here and renamed once complete, so the player never sees half a file
+static const char *TEMP_NAME = "INGEST.TMP";
+// a seek table entry at least every second of audio, further apart for long files
+static const int SEEK_INTERVAL_SECONDS = 1;
+// linear interpolation phase, 16.16 fixed point in source frames
+static const uint32_t PHASE_ONE = 1 << 16;
+
+#pragma pack(push, 1)
+// the "isrc" chunk - where a cached file came from and what it was made for
+typedef struct
+{
+  uint32_t source_size;
+  uint32_t source_mtime;
+  uint32_t sample_rate;
+  uint16_t channels;
+  uint16_t version;
+} cache_source_t;
+
+typedef struct
+{
+  uint16_t audio_format;
+  uint16_t num_channels;
+  uint32_t sample_rate;
+  uint32_t byte_rate;
+  uint16_t sample_alignment;
+  uint16_t bit_depth;
+} cache_fmt_t;
+#pragma pack(pop)
+
+// the isrc chunk always follows the fmt chunk: RIFF header, fmt chunk, isrc chunk header
+static const long ISRC_OFFSET = 12 + 8 + sizeof(cache_fmt_t) + 8;
+
+/**
+ * Pulls frames out of a source file one at a time, decoded to 16 bit with the
+ * cache's channel count
+ **/
+class SourceFrames
+{
+private:
+  WAVFileReader *m_reader;
+  int m_sample_bytes;
+  int m_source_channels;
+  int m_channels;
+  bool m_float;
+  uint8_t m_raw[INGEST_CHUNK_FRAMES * MAX_SOURCE_FRAME_BYTES];
+  int m_count = 0;
+  int m_next = 0;
+
+  int16_t decode(const uint8_t *sample)
+  {
+    switch (m_sample_bytes)
+    {
+    case 1:
+      // 8 bit wav is unsigned - multiply rather than shift a negative value
+      return (int16_t)((sample[0] - 128) * 256);
+    case 2:
+      return (int16_t)(sample[0] | sample[1] << 8);
+    case 3:
+      return (int16_t)(sample[1] | sample[2] << 8);
+    default:
+      if (m_float)
+      {
+        float value;
+        memcpy(&value, sample, sizeof(value));
+        value *= 32768.0f;
+        return value >= 32767.0f ? 32767 : value <= -32768.0f ? -32768 : (int16_t)value;
+      }
+      return (int16_t)(sample[2] | sample[3] << 8);
+    }
+  }
+
+public:
+  SourceFrames(WAVFileReader *reader, int channels)
+      : m_reader(reader), m_sample_bytes(reader->bit_depth() / 8), m_source_channels(reader->channels()),
+        m_channels(channels), m_float(reader->audio_format() == WAV_FORMAT_IEEE_FLOAT)
+  {
+  }
+
+  bool next(int16_t *frame)
+  {
+    if (m_next == m_count)
+    {
+      m_count = m_reader->read_raw(m_raw, INGEST_CHUNK_FRAMES);
+      m_next = 0;
+      if (m_count <= 0)
+      {
+        return false;
+      }
+    }
+    const uint8_t *raw = m_raw + m_next++ * m_source_channels * m_sample_bytes;
+    int16_t left = decode(raw);
+    int16_t right = m_source_channels == 2 ? decode(raw + m_sample_bytes) : left;
+    if (m_channels == 1)
+    {
+      frame[0] = (left + right) >> 1;
+    }
+    else
+    {
+      frame[0] = left;
+      frame[1] = right;
+    }
+    return true;
+  }
+};
+
+static void write_chunk_header(FILE *fp, const char *id, uint32_t size)
+{
+  fwrite(id, 4, 1, fp);
+  fwrite(&size, 4, 1, fp);
+}
+
+// writes everything up to the data chunk header, padding with a JUNK chunk so
+// the samples start on CACHE_DATA_ALIGN - returns the offset of the samples
+static long write_header(FILE *fp, int sample_rate, int channels, const cache_source_t &source, int loop_start, int loop_end)
+{
+  write_chunk_header(fp, "RIFF", 0);
+  fwrite("WAVE", 4, 1, fp);
+  cache_fmt_t fmt = {
+      WAV_FORMAT_PCM,
+      (uint16_t)channels,
+      (uint32_t)sample_rate,
+      (uint32_t)(sample_rate * channels * sizeof(int16_t)),
+      (uint16_t)(channels * sizeof(int16_t)),
+      16};
+  write_chunk_header(fp, "fmt ", sizeof(fmt));
+  fwrite(&fmt, sizeof(fmt), 1, fp);
+  write_chunk_header(fp, "isrc", sizeof(source));
+  fwrite(&source, sizeof(source), 1, fp);
+  if (loop_end > loop_start)
+  {
+    // header (manufacturer, product, sample period, unity note, pitch fraction,
+    // smpte format and offset, loop count, sampler data) then one loop with an inclusive end
+    uint32_t smpl[SMPL_SIZE / 4] = {
+        0, 0, (uint32_t)(1000000000 / sample_rate), 60, 0, 0, 0, 1, 0,
+        0, 0, (uint32_t)loop_start, (uint32_t)(loop_end - 1), 0, 0};
+    write_chunk_header(fp, "smpl", SMPL_SIZE);
+    fwrite(smpl, SMPL_SIZE, 1, fp);
+  }
+  // the JUNK header and the data header come before the samples
+  uint32_t padding = (CACHE_DATA_ALIGN - (ftell(fp) + 16) % CACHE_DATA_ALIGN) % CACHE_DATA_ALIGN;
+  write_chunk_header(fp, "JUNK", padding);
+  static const uint8_t zeros[256] = {0};
+  while (padding > 0)
+  {
+    uint32_t size = padding < sizeof(zeros) ? padding : sizeof(zeros);
+    fwrite(zeros, size, 1, fp);
+    padding -= size;
+  }
+  write_chunk_header(fp, "data", 0);
+  return ftell(fp);
+}
+
+// appends a coarse "seek" chunk after the samples so WAVFileReader::seek
+// starts from a nearby entry instead of the start of the data
+static bool write_seek_table(FILE *fp, int frames, int sample_rate, int channels)
+{
+  int interval = sample_rate * SEEK_INTERVAL_SECONDS;
+  if (frames / interval >= MAX_SEEK_ENTRIES)
+  {
+    interval = frames / MAX_SEEK_ENTRIES + 1;
+  }
+  int entries = (frames - 1) / interval;
+  if (entries <= 0)
+  {
+    return true;
+  }
+  write_chunk_header(fp, "seek", entries * sizeof(wav_seek_entry_t));
+  for (int i = 1; i <= entries; i++)
+  {
+    wav_seek_entry_t entry = {(uint32_t)(i * interval), (uint32_t)(i * interval * channels * sizeof(int16_t))};
+    if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+AssetCache::AssetCache(const char *source_dir, const char *cache_dir, int sample_rate, int channels)
+    : m_source_dir(source_dir), m_cache_dir(cache_dir), m_sample_rate(sample_rate), m_channels(channels)
+{
+  m_files_lock = xSemaphoreCreateMutex();
+  if (mkdir(m_cache_dir, 0777) != 0 && errno != EEXIST)
+  {
+    ESP_LOGE(TAG, "Cannot create %s", m_cache_dir);
+    return;
+  }
+  // lowest priority so ingest only runs when playback and control have nothing to do
+  xTaskCreate(task, "asset_cache_task", 4096, this, 1, NULL);
+}
+
+void AssetCache::task(void *param)
+{
+  static_cast<AssetCache *>(param)->run();
+}
+
+void AssetCache::run()
+{
+  while (1)
+  {
+    scan();
+    prune();
+    vTaskDelay(pdMS_TO_TICKS(CACHE_SCAN_INTERVAL_MS));
+  }
+}
+
+void AssetCache::lock()
+{
+  xSemaphoreTake(m_files_lock, portMAX_DELAY);
+}
+
+void AssetCache::unlock()
+{
+  xSemaphoreGive(m_files_lock);
+}
+
+bool AssetCache::cache_path(const char *source_path, char *path, int size)
+{
+  const char *name = strrchr(source_path, '/');
+  int length = snprintf(path, size, "%s/%s", m_cache_dir, name ? name + 1 : source_path);
+  return length >= 0 && length < size;
+}
+
+const char *AssetCache::resolve(const char *source_path, char *path, int size)
+{
+  if (!cache_path(source_path, path, size))
+  {
+    return source_path;
+  }
+  return is_fresh(source_path, path) ? path : source_path;
+}
+
+bool AssetCache::is_fresh(const char *source_path, const char *cache_path)
+{
+  struct stat source_stat;
+  if (stat(source_path, &source_stat) != 0)
+  {
+    return false;
+  }
+  FILE *fp = fopen(cache_path, "rb");
+  if (!fp)
+  {
+    return false;
+  }
+  char id[4];
+  cache_source_t source;
+  bool found = fseek(fp, ISRC_OFFSET - 8, SEEK_SET) == 0 &&
+               fread(id, 4, 1, fp) == 1 && memcmp(id, "isrc", 4) == 0 &&
+               fseek(fp, ISRC_OFFSET, SEEK_SET) == 0 &&
+               fread(&source, sizeof(source), 1, fp) == 1;
+  fclose(fp);
+  return found &&
+         source.source_size == (uint32_t)source_stat.st_size &&
+         source.source_mtime == (uint32_t)source_stat.st_mtime &&
+         source.sample_rate == (uint32_t)m_sample_rate &&
+         source.channels == m_channels &&
+         source.version == CACHE_VERSION;
+}
+
+bool AssetCache::is_native(WAVFileReader *reader)
+{
+  return reader->audio_format() == WAV_FORMAT_PCM && reader->bit_depth() == 16 &&
+         reader->sample_rate() == m_sample_rate && reader->channels() == m_channels;
+}
+
+void AssetCache::scan()
+{
+  DIR *dir = opendir(m_source_dir);
+  if (!dir)
+  {
+    ESP_LOGE(TAG, "Cannot open %s", m_source_dir);
+    return;
+  }
+  char source_path[64];
+  char cached_path[64];
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL)
+  {
+    // d_name can hold far more than an 8.3 name, skip anything that doesn't fit our buffers
+    int length = strlen(ent->d_name);
+    if (ent->d_type != DT_REG || length < 4 || length >= (int)sizeof(Skipped::name) ||
+        strcasecmp(ent->d_name + length - 4, ".wav") != 0)
+    {
+      continue;
+    }
+    int path_length = snprintf(source_path, sizeof(source_path), "%s/%s", m_source_dir, ent->d_name);
+    if (path_length < 0 || path_length >= (int)sizeof(source_path) || !cache_path(source_path, cached_path, sizeof(cached_path)))
+    {
+      continue;
+    }
+    if (is_fresh(source_path, cached_path))
+    {
+      continue;
+    }
+    struct stat source_stat;
+    if (stat(source_path, &source_stat) != 0)
+    {
+      continue;
+    }
+    // files that are already native or can't be transcoded are remembered so
+    // they are only opened again when they change, failed transcodes are retried
+    Skipped *skipped = nullptr;
+    for (int i = 0; i < m_skipped_count && !skipped; i++)
+    {
+      if (strcmp(m_skipped[i].name, ent->d_name) == 0)
+      {
+        skipped = &m_skipped[i];
+      }
+    }
+    if (skipped && skipped->size == (uint32_t)source_stat.st_size && skipped->mtime == (uint32_t)source_stat.st_mtime)
+    {
+      continue;
+    }
+    if (transcode(source_path, cached_path) != TRANSCODE_SKIPPED)
+    {
+      continue;
+    }
+    if (!skipped)
+    {
+      skipped = &m_skipped[m_skipped_count < MAX_SKIPPED_ASSETS ? m_skipped_count++ : 0];
+    }
+    memcpy(skipped->name, ent->d_name, length + 1);
+    skipped->size = source_stat.st_size;
+    skipped->mtime = source_stat.st_mtime;
+  }
+  closedir(dir);
+}
+
+void AssetCache::prune()
+{
+  DIR *dir = opendir(m_cache_dir);
+  if (!dir)
+  {
+    return;
+  }
+  char source_path[64];
+  char cached_path[64];
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL)
+  {
+    int path_length = snprintf(source_path, sizeof(source_path), "%s/%s", m_source_dir, ent->d_name);
+    if (path_length < 0 || path_length >= (int)sizeof(source_path) || !cache_path(source_path, cached_path, sizeof(cached_path)))
+    {
+      continue;
+    }
+    struct stat source_stat;
+    if (ent->d_type != DT_REG || stat(source_path, &source_stat) == 0)
+    {
+      continue;
+    }
+    ESP_LOGI(TAG, "Removing %s, its source is gone", cached_path);
+    lock();
+    unlink(cached_path);
+    unlock();
+  }
+  closedir(dir);
+}
+
+AssetCache::TranscodeResult AssetCache::transcode(const char *source_path, const char *cached_path)
+{
+  struct stat source_stat;
+  FILE *source_fp = fopen(source_path, "rb");
+  if (!source_fp || fstat(fileno(source_fp), &source_stat) != 0)
+  {
+    ESP_LOGE(TAG, "Cannot open %s", source_path);
+    if (source_fp)
+    {
+      fclose(source_fp);
+    }
+    return TRANSCODE_FAILED;
+  }
+  WAVFileReader *reader = new WAVFileReader(source_fp);
+  int format = reader->audio_format();
+  int bits = reader->bit_depth();
+  bool decodable = (format == WAV_FORMAT_PCM && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) ||
+                   (format == WAV_FORMAT_IEEE_FLOAT && bits == 32);
+  struct stat cached_stat;
+  TranscodeResult result = TRANSCODE_SKIPPED;
+  if (is_native(reader))
+  {
+    // played straight from the source, drop any copy made from an older version
+    if (stat(cached_path, &cached_stat) == 0)
+    {
+      lock();
+      unlink(cached_path);
+      unlock();
+    }
+  }
+  else if (!decodable || reader->num_frames() == 0 || reader->sample_alignment() != reader->channels() * bits / 8)
+  {
+    ESP_LOGW(TAG, "Cannot transcode %s (format %d, %d bits)", source_path, format, bits);
+  }
+  else
+  {
+    bool ok = false;
+    char temp_path[64];
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", m_cache_dir, TEMP_NAME);
+    FILE *out = fopen(temp_path, "wb");
+    int16_t *out_frames = (int16_t *)malloc(INGEST_CHUNK_FRAMES * m_channels * sizeof(int16_t));
+    SourceFrames *frames = new SourceFrames(reader, m_channels);
+    if (!out || !out_frames || !frames)
+    {
+      ESP_LOGE(TAG, "Cannot start transcoding %s", source_path);
+    }
+    else
+    {
+      ESP_LOGI(TAG, "Transcoding %s: %d Hz %d ch %d bit -> %d Hz %d ch 16 bit",
+               source_path, reader->sample_rate(), reader->channels(), bits, m_sample_rate, m_channels);
+      cache_source_t source = {(uint32_t)source_stat.st_size, (uint32_t)source_stat.st_mtime,
+                               (uint32_t)m_sample_rate, (uint16_t)m_channels, CACHE_VERSION};
+      int loop_start = 0, loop_end = 0;
+      if (reader->has_loop())
+      {
+        loop_start = (int64_t)reader->loop_start() * m_sample_rate / reader->sample_rate();
+        loop_end = (int64_t)reader->loop_end() * m_sample_rate / reader->sample_rate();
+      }
+      long data_offset = write_header(out, m_sample_rate, m_channels, source, loop_start, loop_end);
+
+      // resample with linear interpolation between the prev and cur source frames
+      uint32_t step = ((uint64_t)reader->sample_rate() << 16) / m_sample_rate;
+      uint32_t phase = 0;
+      int16_t prev[2], cur[2];
+      bool exhausted = false, finished = false;
+      if (!frames->next(prev))
+      {
+        finished = true;
+      }
+      else if (!frames->next(cur))
+      {
+        memcpy(cur, prev, sizeof(cur));
+        exhausted = true;
+      }
+      int total_frames = reader->num_frames();
+      int reported = 0;
+      ok = true;
+      while (!finished && ok)
+      {
+        int count = 0;
+        while (count < INGEST_CHUNK_FRAMES)
+        {
+          while (phase >= PHASE_ONE)
+          {
+            if (exhausted)
+            {
+              finished = true;
+              break;
+            }
+            memcpy(prev, cur, sizeof(prev));
+            if (!frames->next(cur))
+            {
+              // hold the last frame for the final interpolation
+              exhausted = true;
+            }
+            phase -= PHASE_ONE;
+          }
+          if (finished)
+          {
+            break;
+          }
+          for (int c = 0; c < m_channels; c++)
+          {
+            out_frames[count * m_channels + c] = prev[c] + (((int32_t)(cur[c] - prev[c]) * (int32_t)(phase >> 1)) >> 15);
+          }
+          phase += step;
+          count++;
+        }
+        if (fwrite(out_frames, m_channels * sizeof(int16_t), count, out) != (size_t)count)
+        {
+          ESP_LOGE(TAG, "Write failed transcoding %s", source_path);
+          ok = false;
+        }
+        m_progress = (int64_t)reader->position() * 100 / total_frames;
+        if (m_progress >= reported + 25)
+        {
+          reported = m_progress - m_progress % 25;
+          ESP_LOGI(TAG, "%s: %d%%", source_path, reported);
+        }
+      }
+      long data_end = ftell(out);
+      if (ok)
+      {
+        ok = write_seek_table(out, (data_end - data_offset) / (m_channels * sizeof(int16_t)), m_sample_rate, m_channels);
+      }
+      if (ok)
+      {
+        // fill in the sizes now that we know them
+        uint32_t riff_size = ftell(out) - 8;
+        uint32_t data_size = data_end - data_offset;
+        ok = fseek(out, 4, SEEK_SET) == 0 && fwrite(&riff_size, 4, 1, out) == 1 &&
+             fseek(out, data_offset - 4, SEEK_SET) == 0 && fwrite(&data_size, 4, 1, out) == 1;
+      }
+    }
+    delete frames;
+    free(out_frames);
+    if (out && fclose(out) != 0)
+    {
+      ok = false;
+    }
+    if (ok)
+    {
+      // swap in the new copy while no one is playing from the cache
+      lock();
+      unlink(cached_path);
+      ok = rename(temp_path, cached_path) == 0;
+      unlock();
+    }
+    if (!ok)
+    {
+      unlink(temp_path);
+    }
+    m_progress = -1;
+    if (ok)
+    {
+      ESP_LOGI(TAG, "Cached %s as %s", source_path, cached_path);
+    }
+    result = ok ? TRANSCODE_DONE : TRANSCODE_FAILED;
+  }
+  delete reader;
+  fclose(source_fp);
+  return result;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdint.h>
+
+class WAVFileReader;
+
+// data in cached files starts on a multiple of this. SD sectors are 512 bytes
+// and FAT clusters are a power of two sectors, at least 4 KB on any card
+// formatted with the SD defaults, so as long as this is a power of two no bigger
+// than the cluster size an aligned 4 KB read never straddles a cluster
+#define CACHE_DATA_ALIGN 4096
+// how often the source directory is checked for new or changed files
+#define CACHE_SCAN_INTERVAL_MS 10000
+// source files remembered as not needing (or not supporting) a transcode
+#define MAX_SKIPPED_ASSETS 32
+
+/**
+ * Ingest stage for the WAV files on the SD card. A low priority task scans the
+ * source directory and transcodes every file that isn't already in the
+ * pipeline's native format (16 bit PCM at the pipeline's sample rate and
+ * channel count) into a cache directory, with the data chunk aligned to
+ * CACHE_DATA_ALIGN. Each cached file records the size and modification time
+ * of its source, so a changed source is transcoded again and playback only
+ * uses cached files that are fresh.
+ **/
+class AssetCache
+{
+private:
+  enum TranscodeResult
+  {
+    // a fresh cached copy was written
+    TRANSCODE_DONE,
+    // already native or not decodable, nothing to do until the source changes
+    TRANSCODE_SKIPPED,
+    // I/O error or out of memory, tried again on the next scan
+    TRANSCODE_FAILED
+  };
+  struct Skipped
+  {
+    // 8.3 name
+    char name[13];
+    uint32_t size;
+    uint32_t mtime;
+  };
+
+  const char *m_source_dir;
+  const char *m_cache_dir;
+  int m_sample_rate;
+  int m_channels;
+  // held by the player while it has files open, and by the ingest task while
+  // it replaces or removes cached files
+  SemaphoreHandle_t m_files_lock;
+  // progress of the file being transcoded, -1 when the task is waiting
+  volatile int m_progress = -1;
+  Skipped m_skipped[MAX_SKIPPED_ASSETS];
+  int m_skipped_count = 0;
+
+  static void task(void *param);
+  void run();
+  void scan();
+  void prune();
+  bool is_fresh(const char *source_path, const char *cache_path);
+  bool is_native(WAVFileReader *reader);
+  TranscodeResult transcode(const char *source_path, const char *cache_path);
+  // false if the path doesn't fit in size
+  bool cache_path(const char *source_path, char *path, int size);
+
+public:
+  AssetCache(const char *source_dir, const char *cache_dir, int sample_rate, int channels);
+  // the path to play for a source file - the cached copy if it is fresh,
+  // otherwise the source itself
+  const char *resolve(const char *source_path, char *path, int size);
+  // hold while any files from resolve() are open
+  void lock();
+  void unlock();
+  // percent done of the file being transcoded, -1 if nothing is
+  int progress() { return m_progress; }
+};
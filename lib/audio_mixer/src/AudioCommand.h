@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+// voices the engine can play
+#define VOICE_MAIN 0
+#define VOICE_MIX 1
+#define NUM_VOICES 2
+
+// gain of 1.0 for audio_command_t::gain and Voice::set_gain
+#define GAIN_UNITY 256
+
+typedef enum : uint8_t
+{
+  AUDIO_CMD_TRIGGER = 0x01,
+  AUDIO_CMD_STOP = 0x02,
+  AUDIO_CMD_GAIN = 0x03,
+  AUDIO_CMD_STATUS = 0x04,
+  AUDIO_CMD_SEEK = 0x05
+} audio_command_type_t;
+
+// audio_command_t::flags - schedule the command relative to received_us
+// instead of applying it as soon as the engine sees it
+#define AUDIO_CMD_FLAG_AT_EVENT_TIME 0x01
+
+/**
+ * A command for the audio engine - fixed size so it can be copied through a
+ * FreeRTOS queue without any allocation
+ **/
+typedef struct
+{
+  uint8_t type;
+  uint8_t voice;
+  // GAIN_UNITY is 1.0
+  uint16_t gain;
+  uint8_t flags;
+  // frame to play from for AUDIO_CMD_SEEK
+  uint32_t position;
+  // engine sample clock to apply the command at, 0 applies it straight away
+  uint32_t timestamp;
+  // esp_timer time the command was received (or its input event happened),
+  // used to measure command to apply latency
+  int64_t received_us;
+} audio_command_t;
+
+// snapshot of the engine state reported back to a controller
+typedef struct
+{
+  // one bit per voice
+  uint8_t active_voices;
+  // blocks waiting for the output task
+  uint8_t queued_blocks;
+  // free slots in the command queue
+  uint8_t free_commands;
+  uint32_t sample_clock;
+  uint32_t max_latency_us;
+} audio_status_t;
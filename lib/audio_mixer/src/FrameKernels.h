@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include "AudioCommand.h"
+
+/**
+ * Converts interleaved frames from a source layout to the pipeline layout and
+ * applies a per channel gain in the same pass. Each channel combination has
+ * its own kernel so the inner loops have no per sample channel logic. in and
+ * out may point at the same buffer as long as it is big enough for the output.
+ **/
+template <int IN_CHANNELS, int OUT_CHANNELS>
+struct FrameKernel;
+
+static inline int16_t apply_gain(int32_t sample, int gain)
+{
+  sample = (sample * gain) >> 8;
+  return sample > INT16_MAX ? INT16_MAX : (sample < INT16_MIN ? INT16_MIN : sample);
+}
+
+// same layout - only the gain needs applying, which is skipped at unity
+template <>
+struct FrameKernel<1, 1>
+{
+  static void convert(const int16_t *in, int16_t *out, int count, int gain_left, int gain_right)
+  {
+    if (gain_left == GAIN_UNITY)
+    {
+      if (in != out)
+      {
+        for (int i = 0; i < count; i++)
+        {
+          out[i] = in[i];
+        }
+      }
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      out[i] = apply_gain(in[i], gain_left);
+    }
+  }
+};
+
+template <>
+struct FrameKernel<2, 2>
+{
+  static void convert(const int16_t *in, int16_t *out, int count, int gain_left, int gain_right)
+  {
+    if (gain_left == GAIN_UNITY && gain_right == GAIN_UNITY)
+    {
+      if (in != out)
+      {
+        for (int i = 0; i < count * 2; i++)
+        {
+          out[i] = in[i];
+        }
+      }
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      out[i * 2] = apply_gain(in[i * 2], gain_left);
+      out[i * 2 + 1] = apply_gain(in[i * 2 + 1], gain_right);
+    }
+  }
+};
+
+// mono to stereo with panning - runs backwards so it can expand in place
+template <>
+struct FrameKernel<1, 2>
+{
+  static void convert(const int16_t *in, int16_t *out, int count, int gain_left, int gain_right)
+  {
+    for (int i = count - 1; i >= 0; i--)
+    {
+      int16_t sample = in[i];
+      out[i * 2 + 1] = apply_gain(sample, gain_right);
+      out[i * 2] = apply_gain(sample, gain_left);
+    }
+  }
+};
+
+// stereo down to mono - runs forwards so it can shrink in place
+template <>
+struct FrameKernel<2, 1>
+{
+  static void convert(const int16_t *in, int16_t *out, int count, int gain_left, int gain_right)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      int32_t sample = ((int32_t)in[i * 2] * gain_left + (int32_t)in[i * 2 + 1] * gain_right) >> 9;
+      out[i] = sample > INT16_MAX ? INT16_MAX : (sample < INT16_MIN ? INT16_MIN : sample);
+    }
+  }
+};
@@ -0,0 +1,55 @@
+
+#include "Mixer.h"
+
+template <int CHANNELS>
+Mixer<CHANNELS>::Mixer(int hold_blocks) : m_hold_blocks(hold_blocks), m_silent_blocks(hold_blocks)
+{
+}
+
+template <int CHANNELS>
+void Mixer<CHANNELS>::mix(const int16_t *a, const int16_t *b, int16_t *out, int count)
+{
+  // the frames are interleaved so the channels can be treated as one long run of samples
+  for (int i = 0; i < count * CHANNELS; i++)
+  {
+    int32_t mixed = (int32_t)a[i] + (int32_t)b[i];
+    out[i] = (int16_t)(mixed / 2);
+  }
+}
+
+template <int CHANNELS>
+bool Mixer<CHANNELS>::is_silent(const int16_t *frames, int count)
+{
+  // OR everything together - any set bit means the block is not silent. This
+  // has no compare in the loop so it runs at close to load bandwidth
+  const int samples = count * CHANNELS;
+  int16_t acc = 0;
+  int i = 0;
+  for (; i + 4 <= samples; i += 4)
+  {
+    acc |= frames[i] | frames[i + 1] | frames[i + 2] | frames[i + 3];
+  }
+  for (; i < samples; i++)
+  {
+    acc |= frames[i];
+  }
+  return acc == 0;
+}
+
+template <int CHANNELS>
+bool Mixer<CHANNELS>::update(const int16_t *frames, int count)
+{
+  if (!is_silent(frames, count))
+  {
+    m_silent_blocks = 0;
+    return false;
+  }
+  if (m_silent_blocks < m_hold_blocks)
+  {
+    m_silent_blocks++;
+  }
+  return is_idle();
+}
+
+template class Mixer<1>;
+template class Mixer<2>;
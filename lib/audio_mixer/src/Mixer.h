@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Mixes the playing sources into one block of interleaved frames with
+ * CHANNELS channels and keeps track of how long the mix has been silent so
+ * the engine can drop into its idle mode
+ **/
+template <int CHANNELS>
+class Mixer
+{
+private:
+  // number of consecutive silent blocks before the mix counts as idle
+  int m_hold_blocks;
+  int m_silent_blocks;
+
+public:
+  // starts out idle, nothing has been played yet
+  Mixer(int hold_blocks);
+  // average two blocks of frames into out
+  static void mix(const int16_t *a, const int16_t *b, int16_t *out, int count);
+  // true if every sample in the block of frames is zero
+  static bool is_silent(const int16_t *frames, int count);
+  // feed a rendered block of frames, returns true once the mix has been silent for the hold time
+  bool update(const int16_t *frames, int count);
+  bool is_idle() { return m_silent_blocks >= m_hold_blocks; }
+  // restart the hold time, e.g. when something is triggered
+  void wake() { m_silent_blocks = 0; }
+};
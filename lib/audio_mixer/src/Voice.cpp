@@ -0,0 +1,174 @@
+
+#include "Voice.h"
+#include "FrameKernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+static const char *TAG = "VOICE";
+
+// frames per pass when a source has more channels than the pipeline
+static const int DOWNMIX_CHUNK_FRAMES = 128;
+
+template <int CHANNELS>
+Voice<CHANNELS>::Voice(WAVFileReader *reader) : m_reader(reader), m_source_channels(reader->channels())
+{
+  m_position = m_reader->position();
+  if (m_reader->has_loop())
+  {
+    set_loop(m_reader->loop_start(), m_reader->loop_end());
+  }
+}
+
+template <int CHANNELS>
+Voice<CHANNELS>::~Voice()
+{
+  free(m_loop_cache);
+}
+
+template <int CHANNELS>
+void Voice<CHANNELS>::set_loop(int start, int end)
+{
+  clear_loop();
+  if (start < 0 || end <= start || end > m_reader->num_frames())
+  {
+    ESP_LOGE(TAG, "Invalid loop %d-%d", start, end);
+    return;
+  }
+  m_loop_start = start;
+  m_loop_end = end;
+  // short loops get a RAM copy, filled as the loop plays through the first time
+  if (end - start <= MAX_CACHED_LOOP_FRAMES)
+  {
+    m_loop_cache = (int16_t *)malloc((end - start) * sizeof(int16_t) * m_source_channels);
+    m_loop_cached = 0;
+  }
+  ESP_LOGI(TAG, "Looping %d-%d%s", start, end, m_loop_cache ? " via RAM" : "");
+}
+
+template <int CHANNELS>
+void Voice<CHANNELS>::clear_loop()
+{
+  if (m_loop_cache)
+  {
+    free(m_loop_cache);
+    m_loop_cache = nullptr;
+    m_loop_cached = 0;
+  }
+  m_loop_start = 0;
+  m_loop_end = 0;
+}
+
+template <int CHANNELS>
+int Voice<CHANNELS>::seek(int frame)
+{
+  if (m_loop_cache && frame >= m_loop_start && frame < m_loop_start + m_loop_cached)
+  {
+    // inside the cached part of the loop - no need to touch storage
+    m_position = frame;
+    return m_position;
+  }
+  m_position = m_reader->seek(frame);
+  return m_position;
+}
+
+template <int CHANNELS>
+int Voice<CHANNELS>::read_source(int16_t *frames, int count)
+{
+  // work in runs that end at the loop point, so the wrap costs one check per
+  // run instead of one per sample
+  int produced = 0;
+  while (produced < count)
+  {
+    int run = count - produced;
+    int16_t *out = frames + produced * m_source_channels;
+    bool in_loop = m_loop_end != 0 && m_position < m_loop_end;
+    if (in_loop && run > m_loop_end - m_position)
+    {
+      run = m_loop_end - m_position;
+    }
+    int cached_end = m_loop_start + m_loop_cached;
+    if (in_loop && m_loop_cache && m_position >= m_loop_start && m_position < cached_end)
+    {
+      if (run > cached_end - m_position)
+      {
+        run = cached_end - m_position;
+      }
+      memcpy(out, m_loop_cache + (m_position - m_loop_start) * m_source_channels,
+             run * sizeof(int16_t) * m_source_channels);
+    }
+    else
+    {
+      if (m_loop_cache && cached_end < m_loop_end && m_position < m_loop_start && run > m_loop_start - m_position)
+      {
+        // stop at the loop start so the first pass through the loop lands in the cache
+        run = m_loop_start - m_position;
+      }
+      // the reader is left behind while playing from the cache
+      if (m_reader->position() != m_position)
+      {
+        m_reader->seek(m_position);
+      }
+      int read = m_reader->read(out, run);
+      if (in_loop && m_loop_cache && m_position == cached_end)
+      {
+        memcpy(m_loop_cache + m_loop_cached * m_source_channels, out, read * sizeof(int16_t) * m_source_channels);
+        m_loop_cached += read;
+      }
+      if (read < run)
+      {
+        // end of the data
+        produced += read;
+        m_position += read;
+        break;
+      }
+    }
+    produced += run;
+    m_position += run;
+    if (in_loop && m_position == m_loop_end)
+    {
+      m_position = m_loop_start;
+    }
+  }
+  return produced;
+}
+
+template <int CHANNELS>
+int Voice<CHANNELS>::read(int16_t *frames, int count)
+{
+  // balance between the channels, at the centre both get the full gain
+  int gain_left = m_pan > 0 ? (m_gain * (GAIN_UNITY - m_pan)) >> 8 : m_gain;
+  int gain_right = m_pan < 0 ? (m_gain * (GAIN_UNITY + m_pan)) >> 8 : m_gain;
+  if (m_source_channels <= CHANNELS)
+  {
+    // the source fits in the output buffer so convert it in place
+    int produced = read_source(frames, count);
+    if (m_source_channels == 1)
+    {
+      FrameKernel<1, CHANNELS>::convert(frames, frames, produced, gain_left, gain_right);
+    }
+    else
+    {
+      FrameKernel<2, CHANNELS>::convert(frames, frames, produced, gain_left, gain_right);
+    }
+    return produced;
+  }
+  // more source channels than output channels - go through a small scratch buffer
+  int16_t scratch[DOWNMIX_CHUNK_FRAMES * 2];
+  int produced = 0;
+  while (produced < count)
+  {
+    int chunk = count - produced < DOWNMIX_CHUNK_FRAMES ? count - produced : DOWNMIX_CHUNK_FRAMES;
+    int read = read_source(scratch, chunk);
+    FrameKernel<2, CHANNELS>::convert(scratch, frames + produced * CHANNELS, read, gain_left, gain_right);
+    produced += read;
+    if (read < chunk)
+    {
+      break;
+    }
+  }
+  return produced;
+}
+
+template class Voice<1>;
+template class Voice<2>;
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include "WAVFileReader.h"
+#include "AudioCommand.h"
+
+// loops up to this many frames long are held in RAM and never touch storage after their first pass
+#define MAX_CACHED_LOOP_FRAMES 16384
+
+/**
+ * A single source feeding the mixer, with an optional sample accurate loop
+ * region taken from the WAV smpl chunk or set with set_loop. Frames come out
+ * interleaved with CHANNELS channels whatever the layout of the source, mono
+ * sources are panned on the way.
+ **/
+template <int CHANNELS>
+class Voice
+{
+private:
+  WAVFileReader *m_reader;
+  int m_source_channels;
+  // next frame to play
+  int m_position = 0;
+  // loop region in frames - m_loop_end is exclusive and 0 if the voice does not loop
+  int m_loop_start = 0;
+  int m_loop_end = 0;
+  // copy of the loop region for short loops, in the source layout - filled
+  // while the loop plays for the first time so setting a loop never blocks on storage
+  int16_t *m_loop_cache = nullptr;
+  // frames from the loop start copied into m_loop_cache so far
+  int m_loop_cached = 0;
+  // GAIN_UNITY is 1.0
+  int m_gain = GAIN_UNITY;
+  // -GAIN_UNITY is hard left, GAIN_UNITY is hard right
+  int m_pan = 0;
+
+  // read frames in the source layout
+  int read_source(int16_t *frames, int count);
+
+public:
+  Voice(WAVFileReader *reader);
+  ~Voice();
+  // loop the frames from start up to (but not including) end until clear_loop is called
+  void set_loop(int start, int end);
+  void clear_loop();
+  bool is_looping() { return m_loop_end != 0; }
+  void set_gain(int gain) { m_gain = gain; }
+  void set_pan(int pan) { m_pan = pan; }
+  // start playing from the beginning again
+  void restart() { seek(0); }
+  // next frame to be played
+  int position() { return m_position; }
+  // jump to the given frame, returns the frame actually landed on
+  int seek(int frame);
+  // returns fewer than count frames only when a non looping voice reaches the end
+  int read(int16_t *frames, int count);
+};
@@ -1,6 +1,10 @@
 
 #include "DACOutput.h"
 
+DACOutput::DACOutput(i2s_port_t i2s_port) : Output(i2s_port)
+{
+}
+
 void DACOutput::start(int sample_rate)
 {
     // i2s config for writing both channels of I2S
@@ -17,9 +21,32 @@ void DACOutput::start(int sample_rate)
         .tx_desc_auto_clear = true,
         .fixed_mclk = 0};
     //install and start i2s driver
-    i2s_driver_install(I2S_NUM_0, &i2s_config, 0, NULL);
+    i2s_driver_install(m_i2s_port, &i2s_config, 0, NULL);
     // enable the DAC channels
     i2s_set_dac_mode(I2S_DAC_CHANNEL_RIGHT_EN);
     // clear the DMA buffers
-    i2s_zero_dma_buffer(I2S_NUM_0);
+    i2s_zero_dma_buffer(m_i2s_port);
+}
+
+void DACOutput::convert(const int16_t *samples, int16_t *frames, int count, int channels)
+{
+    // flipping the sign bit is the same as adding 32768 with wrap around
+    if (channels == 2)
+    {
+        // only the right DAC channel is enabled, so both slots get the downmix
+        for (int i = 0; i < count; i++)
+        {
+            int16_t mono = (int16_t)(((int32_t)samples[i * 2] + samples[i * 2 + 1]) >> 1);
+            int16_t sample = (int16_t)(mono ^ 0x8000);
+            frames[i * 2] = sample;
+            frames[i * 2 + 1] = sample;
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int16_t sample = (int16_t)(samples[i] ^ 0x8000);
+        frames[i * 2] = sample;
+        frames[i * 2 + 1] = sample;
+    }
 }
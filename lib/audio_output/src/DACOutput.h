@@ -3,15 +3,13 @@
 #include "Output.h"
 
 /**
- * Base Class for both the ADC and I2S sampler
+ * Output to the ESP32 built-in DAC - this is only wired to I2S_NUM_0
  **/
 class DACOutput : public Output
 {
 public:
+    DACOutput(i2s_port_t i2s_port = I2S_NUM_0);
     void start(int sample_rate);
-    virtual int16_t process_sample(int16_t sample)
-    {
-        // DAC needs unsigned 16 bit samples
-        return sample + 32768;
-    }
+    // DAC needs unsigned 16 bit samples
+    void convert(const int16_t *samples, int16_t *frames, int count, int channels);
 };
@@ -2,6 +2,7 @@
 #include "Output.h"
 #include <esp_log.h>
 #include <driver/i2s.h>
+#include <string.h>
 
 static const char *TAG = "OUT";
 
@@ -19,6 +20,33 @@ void Output::stop()
   // i2s_driver_uninstall(m_i2s_port);
 }
 
+void Output::set_sample_rate(int sample_rate)
+{
+  i2s_set_sample_rates(m_i2s_port, sample_rate);
+}
+
+void Output::convert(const int16_t *samples, int16_t *frames, int count, int channels)
+{
+  if (channels == 2)
+  {
+    // already in the right layout
+    memcpy(frames, samples, count * sizeof(int16_t) * 2);
+    return;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    frames[i * 2] = samples[i];
+    frames[i * 2 + 1] = samples[i];
+  }
+}
+
+int Output::write_frames(const int16_t *frames, int count, TickType_t ticks_to_wait)
+{
+  size_t bytes_written = 0;
+  i2s_write(m_i2s_port, frames, count * sizeof(int16_t) * 2, &bytes_written, ticks_to_wait);
+  return bytes_written / (sizeof(int16_t) * 2);
+}
+
 void Output::write(int16_t *samples, int count)
 {
   // this will contain the prepared samples for sending to the I2S device
@@ -26,19 +54,15 @@ void Output::write(int16_t *samples, int count)
   int sample_index = 0;
   while (sample_index < count)
   {
-    int samples_to_send = 0;
-    for (int i = 0; i < NUM_FRAMES_TO_SEND && sample_index < count; i++)
+    int samples_to_send = count - sample_index;
+    if (samples_to_send > NUM_FRAMES_TO_SEND)
     {
-      int sample = process_sample(samples[sample_index]);
-      frames[i * 2] = sample;
-      frames[i * 2 + 1] = sample;
-      samples_to_send++;
-      sample_index++;
+      samples_to_send = NUM_FRAMES_TO_SEND;
     }
+    convert(samples + sample_index, frames, samples_to_send, 1);
+    sample_index += samples_to_send;
     // write data to the i2s peripheral
-    size_t bytes_written = 0;
-    i2s_write(m_i2s_port, frames, samples_to_send * sizeof(int16_t) * 2, &bytes_written, portMAX_DELAY);
-    if (bytes_written != samples_to_send * sizeof(int16_t) * 2)
+    if (write_frames(frames, samples_to_send, portMAX_DELAY) != samples_to_send)
     {
       ESP_LOGE(TAG, "Did not write all bytes");
     }
@@ -16,9 +16,17 @@ public:
   virtual ~Output() = default;
   virtual void start(int sample_rate) = 0;
   void stop();
-  // override this in derived classes to turn the sample into
-  // something the output device expects - for the default case
-  // this is simply a pass through
-  virtual int16_t process_sample(int16_t sample) { return sample; }
+  // change the sample rate of an output that is already running
+  void set_sample_rate(int sample_rate);
+  i2s_port_t port() const { return m_i2s_port; }
+  // override this in derived classes to turn a block of interleaved frames with
+  // 1 or 2 channels into the left/right frames the output device expects - for
+  // the default case this is simply a pass through, with mono duplicated onto
+  // both channels
+  virtual void convert(const int16_t *samples, int16_t *frames, int count, int channels);
+  // write already converted frames, returns the number of frames accepted
+  // before ticks_to_wait expired
+  int write_frames(const int16_t *frames, int count, TickType_t ticks_to_wait);
+  // write a block of mono samples
   void write(int16_t *samples, int count);
 };
@@ -0,0 +1,137 @@
+
+#include "OutputRouter.h"
+#include <esp_log.h>
+
+static const char *TAG = "ROUTER";
+
+OutputRouter::OutputRouter(int block_size, int channels, int buffered_blocks)
+    : m_capacity(block_size * buffered_blocks), m_channels(channels)
+{
+}
+
+OutputRouter::~OutputRouter()
+{
+  for (int i = 0; i < m_sink_count; i++)
+  {
+    free(m_sinks[i].frames);
+  }
+}
+
+bool OutputRouter::add_sink(Output *output)
+{
+  if (m_sink_count >= MAX_OUTPUT_SINKS)
+  {
+    ESP_LOGE(TAG, "Too many output sinks");
+    return false;
+  }
+  int16_t *frames = (int16_t *)malloc(2 * sizeof(int16_t) * m_capacity);
+  if (!frames)
+  {
+    ESP_LOGE(TAG, "Not enough memory for sink buffer");
+    return false;
+  }
+  m_sinks[m_sink_count++] = {output, frames, 0, 0, 0};
+  return true;
+}
+
+void OutputRouter::start(int sample_rate)
+{
+  if (m_sample_rate != 0)
+  {
+    if (sample_rate != m_sample_rate)
+    {
+      for (int i = 0; i < m_sink_count; i++)
+      {
+        m_sinks[i].output->set_sample_rate(sample_rate);
+      }
+      m_sample_rate = sample_rate;
+    }
+    return;
+  }
+  m_sample_rate = sample_rate;
+  for (int i = 0; i < m_sink_count; i++)
+  {
+    m_sinks[i].read_pos = 0;
+    m_sinks[i].fill = 0;
+    m_sinks[i].output->start(sample_rate);
+  }
+}
+
+void OutputRouter::stop()
+{
+  m_sample_rate = 0;
+  for (int i = 0; i < m_sink_count; i++)
+  {
+    m_sinks[i].output->stop();
+    if (m_sinks[i].dropped)
+    {
+      ESP_LOGW(TAG, "Sink on port %d dropped %d frames", m_sinks[i].output->port(), m_sinks[i].dropped);
+      m_sinks[i].dropped = 0;
+    }
+  }
+}
+
+void OutputRouter::push(Sink &sink, const int16_t *samples, int count)
+{
+  if (count > m_capacity)
+  {
+    samples += (count - m_capacity) * m_channels;
+    sink.dropped += count - m_capacity;
+    count = m_capacity;
+  }
+  // make room by dropping this sink's oldest frames
+  int overflow = sink.fill + count - m_capacity;
+  if (overflow > 0)
+  {
+    sink.read_pos = (sink.read_pos + overflow) % m_capacity;
+    sink.fill -= overflow;
+    sink.dropped += overflow;
+  }
+  // convert straight into the ring, in at most two pieces
+  int write_pos = (sink.read_pos + sink.fill) % m_capacity;
+  int first = count < m_capacity - write_pos ? count : m_capacity - write_pos;
+  sink.output->convert(samples, sink.frames + write_pos * 2, first, m_channels);
+  if (first < count)
+  {
+    sink.output->convert(samples + first * m_channels, sink.frames, count - first, m_channels);
+  }
+  sink.fill += count;
+}
+
+void OutputRouter::drain(Sink &sink, TickType_t ticks_to_wait)
+{
+  while (sink.fill > 0)
+  {
+    int contiguous = sink.fill < m_capacity - sink.read_pos ? sink.fill : m_capacity - sink.read_pos;
+    int written = sink.output->write_frames(sink.frames + sink.read_pos * 2, contiguous, ticks_to_wait);
+    sink.read_pos = (sink.read_pos + written) % m_capacity;
+    sink.fill -= written;
+    if (written < contiguous)
+    {
+      // DMA buffers are full - try again on the next block
+      break;
+    }
+  }
+}
+
+void OutputRouter::write(const int16_t *samples, int count)
+{
+  for (int i = 0; i < m_sink_count; i++)
+  {
+    push(m_sinks[i], samples, count);
+  }
+  // top up the secondary sinks first, they never block
+  for (int i = 1; i < m_sink_count; i++)
+  {
+    drain(m_sinks[i], 0);
+  }
+  if (m_sink_count > 0)
+  {
+    drain(m_sinks[0], portMAX_DELAY);
+  }
+  // the master has consumed a block worth of time, so the others have room again
+  for (int i = 1; i < m_sink_count; i++)
+  {
+    drain(m_sinks[i], 0);
+  }
+}
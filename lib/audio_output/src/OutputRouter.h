@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Output.h"
+
+// maximum number of outputs that can be fed from the same mix
+#define MAX_OUTPUT_SINKS 2
+
+/**
+ * Fans a single mix of interleaved frames out to several outputs (e.g. the PCM5102 on one I2S
+ * port and the built-in DAC on the other). The mix is converted once per sink
+ * into that sink's own ring of frames. The first sink paces the caller, the
+ * others are topped up without blocking so a slow sink only drops its own
+ * oldest frames instead of stalling the rest.
+ **/
+class OutputRouter
+{
+private:
+  struct Sink
+  {
+    Output *output;
+    // interleaved left/right frames waiting to be written
+    int16_t *frames;
+    int read_pos;
+    int fill;
+    int dropped;
+  };
+  Sink m_sinks[MAX_OUTPUT_SINKS];
+  int m_sink_count = 0;
+  // 0 while the sinks are stopped
+  int m_sample_rate = 0;
+  // capacity of each sink's ring in frames
+  int m_capacity;
+  // channels in the frames passed to write
+  int m_channels;
+
+  void push(Sink &sink, const int16_t *samples, int count);
+  void drain(Sink &sink, TickType_t ticks_to_wait);
+
+public:
+  OutputRouter(int block_size, int channels, int buffered_blocks = 4);
+  ~OutputRouter();
+  // the first sink added is the clock master
+  bool add_sink(Output *output);
+  int sink_count() { return m_sink_count; }
+  // starts the sinks, or just changes their sample rate if they are already running
+  void start(int sample_rate);
+  void stop();
+  // frames waiting in the clock master's ring, not yet handed to its DMA buffers
+  int buffered() { return m_sink_count ? m_sinks[0].fill : 0; }
+  // write a block of interleaved frames to every sink
+  void write(const int16_t *samples, int count);
+};
@@ -0,0 +1,214 @@
+
+#include "ControlParser.h"
+#include <string.h>
+
+static uint16_t get_u16(const uint8_t *bytes)
+{
+  return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *bytes)
+{
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void put_u32(uint8_t *bytes, uint32_t value)
+{
+  bytes[0] = value;
+  bytes[1] = value >> 8;
+  bytes[2] = value >> 16;
+  bytes[3] = value >> 24;
+}
+
+uint8_t ControlParser::crc8(uint8_t crc, uint8_t byte)
+{
+  // CRC-8 with polynomial 0x07
+  crc ^= byte;
+  for (int i = 0; i < 8; i++)
+  {
+    crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+// payload length of each command without the optional timestamp, -1 for unknown types
+static int fixed_length(uint8_t type)
+{
+  switch (type)
+  {
+  case AUDIO_CMD_TRIGGER:
+  case AUDIO_CMD_STOP:
+    return 1;
+  case AUDIO_CMD_GAIN:
+    return 3;
+  case AUDIO_CMD_STATUS:
+    return 0;
+  case AUDIO_CMD_SEEK:
+    return 5;
+  default:
+    return -1;
+  }
+}
+
+bool ControlParser::feed(uint8_t byte)
+{
+  uint8_t before = m_ready_count;
+  process(byte);
+  return m_ready_count != before;
+}
+
+bool ControlParser::next(audio_command_t &command)
+{
+  if (m_ready_count == 0)
+  {
+    return false;
+  }
+  command = m_ready[m_ready_head];
+  m_ready_head = (m_ready_head + 1) % CONTROL_READY_SLOTS;
+  m_ready_count--;
+  return true;
+}
+
+void ControlParser::process(uint8_t byte)
+{
+  switch (m_state)
+  {
+  case WAIT_SYNC:
+    if (byte == CONTROL_SYNC)
+    {
+      m_frame_length = 0;
+      m_state = WAIT_TYPE;
+    }
+    return;
+  case WAIT_TYPE:
+    if (byte == CONTROL_SYNC)
+    {
+      // the previous sync was a stray byte, this one may start the frame
+      return;
+    }
+    if (fixed_length(byte) < 0)
+    {
+      m_errors++;
+      m_state = WAIT_SYNC;
+      return;
+    }
+    m_frame[m_frame_length++] = byte;
+    m_type = byte;
+    m_crc = crc8(0, byte);
+    m_state = WAIT_LENGTH;
+    return;
+  case WAIT_LENGTH:
+    m_frame[m_frame_length++] = byte;
+    if (byte != fixed_length(m_type) && byte != fixed_length(m_type) + 4)
+    {
+      reject();
+      return;
+    }
+    m_length = byte;
+    m_count = 0;
+    m_crc = crc8(m_crc, byte);
+    m_state = m_length ? WAIT_PAYLOAD : WAIT_CRC;
+    return;
+  case WAIT_PAYLOAD:
+    m_frame[m_frame_length++] = byte;
+    m_payload[m_count++] = byte;
+    m_crc = crc8(m_crc, byte);
+    if (m_count == m_length)
+    {
+      m_state = WAIT_CRC;
+    }
+    return;
+  case WAIT_CRC:
+    m_frame[m_frame_length++] = byte;
+    audio_command_t command;
+    if (byte != m_crc || !decode(command))
+    {
+      reject();
+      return;
+    }
+    m_state = WAIT_SYNC;
+    if (m_ready_count == CONTROL_READY_SLOTS)
+    {
+      // the caller isn't taking commands, drop the oldest
+      m_ready_head = (m_ready_head + 1) % CONTROL_READY_SLOTS;
+      m_ready_count--;
+      m_errors++;
+    }
+    m_ready[(m_ready_head + m_ready_count) % CONTROL_READY_SLOTS] = command;
+    m_ready_count++;
+    return;
+  }
+}
+
+void ControlParser::reject()
+{
+  m_errors++;
+  m_state = WAIT_SYNC;
+  // the frame may have started at a later sync byte - feed the bytes after
+  // the type again (the type itself can't be a sync byte)
+  uint8_t frame[CONTROL_MAX_FRAME];
+  int length = m_frame_length;
+  memcpy(frame, m_frame, length);
+  int start = 1;
+  while (start < length && frame[start] != CONTROL_SYNC)
+  {
+    start++;
+  }
+  for (int i = start; i < length; i++)
+  {
+    process(frame[i]);
+  }
+}
+
+bool ControlParser::decode(audio_command_t &command)
+{
+  command.type = m_type;
+  command.voice = 0;
+  command.gain = GAIN_UNITY;
+  command.flags = 0;
+  command.position = 0;
+  command.timestamp = 0;
+  command.received_us = 0;
+  // the type and length were checked as they arrived
+  int fixed = fixed_length(m_type);
+  if (m_type == AUDIO_CMD_GAIN)
+  {
+    command.gain = get_u16(m_payload + 1);
+  }
+  else if (m_type == AUDIO_CMD_SEEK)
+  {
+    command.position = get_u32(m_payload + 1);
+  }
+  if (fixed > 0)
+  {
+    command.voice = m_payload[0];
+    if (command.voice >= NUM_VOICES)
+    {
+      return false;
+    }
+  }
+  if (m_length == fixed + 4)
+  {
+    command.timestamp = get_u32(m_payload + fixed);
+  }
+  return true;
+}
+
+int ControlParser::encode_status(const audio_status_t &status, uint8_t *frame)
+{
+  frame[0] = CONTROL_SYNC;
+  frame[1] = CONTROL_REPLY | AUDIO_CMD_STATUS;
+  frame[2] = CONTROL_STATUS_FRAME_SIZE - 4;
+  frame[3] = status.active_voices;
+  frame[4] = status.queued_blocks;
+  frame[5] = status.free_commands;
+  put_u32(frame + 6, status.sample_clock);
+  put_u32(frame + 10, status.max_latency_us);
+  uint8_t crc = 0;
+  for (int i = 1; i < CONTROL_STATUS_FRAME_SIZE - 1; i++)
+  {
+    crc = crc8(crc, frame[i]);
+  }
+  frame[CONTROL_STATUS_FRAME_SIZE - 1] = crc;
+  return CONTROL_STATUS_FRAME_SIZE;
+}
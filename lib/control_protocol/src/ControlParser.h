@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include "AudioCommand.h"
+
+#define CONTROL_SYNC 0xA5
+#define CONTROL_REPLY 0x80
+#define CONTROL_MAX_PAYLOAD 9
+// sync, type, length, 11 byte status and crc
+#define CONTROL_STATUS_FRAME_SIZE 15
+// bytes after the sync byte: type, length, payload and crc
+#define CONTROL_MAX_FRAME (CONTROL_MAX_PAYLOAD + 3)
+// commands that can complete on a single byte when a bad frame is rescanned
+#define CONTROL_READY_SLOTS 4
+
+/**
+ * Framed binary control protocol, all values little endian:
+ *
+ *   0xA5 | type | length | payload[length] | crc8(type, length, payload)
+ *
+ *   TRIGGER 0x01, STOP 0x02: voice [timestamp:4]
+ *   GAIN 0x03:               voice gain:2 [timestamp:4]
+ *   STATUS 0x04:             (empty) - answered with a 0x84 frame
+ *   SEEK 0x05:               voice frame:4 [timestamp:4] - plays the voice from that frame
+ *
+ * The optional timestamp is the engine sample clock to apply the command at.
+ * This class only deals with bytes so it can be driven from any transport.
+ * Unknown types and lengths are rejected as soon as they are seen, and the
+ * bytes of a rejected frame are rescanned for the next sync byte, so a stray
+ * 0xA5 or a corrupted frame never swallows the frame after it.
+ **/
+class ControlParser
+{
+private:
+  enum State
+  {
+    WAIT_SYNC,
+    WAIT_TYPE,
+    WAIT_LENGTH,
+    WAIT_PAYLOAD,
+    WAIT_CRC
+  };
+  State m_state = WAIT_SYNC;
+  uint8_t m_type = 0;
+  uint8_t m_length = 0;
+  uint8_t m_count = 0;
+  uint8_t m_crc = 0;
+  uint8_t m_payload[CONTROL_MAX_PAYLOAD];
+  // everything received since the sync byte, for rescanning a bad frame
+  uint8_t m_frame[CONTROL_MAX_FRAME];
+  uint8_t m_frame_length = 0;
+  // decoded commands waiting for next()
+  audio_command_t m_ready[CONTROL_READY_SLOTS];
+  uint8_t m_ready_head = 0;
+  uint8_t m_ready_count = 0;
+  int m_errors = 0;
+
+  void process(uint8_t byte);
+  void reject();
+  bool decode(audio_command_t &command);
+
+public:
+  // feed one received byte, returns true if it completed any commands
+  bool feed(uint8_t byte);
+  // take the next decoded command, returns false when there are none left
+  bool next(audio_command_t &command);
+  // drop any partial frame, e.g. after the receiver overflowed
+  void reset() { m_state = WAIT_SYNC; }
+  // frames dropped because of a bad length, crc or payload
+  int errors() { return m_errors; }
+  static uint8_t crc8(uint8_t crc, uint8_t byte);
+  // build a status reply frame, returns its length
+  static int encode_status(const audio_status_t &status, uint8_t *frame);
+};
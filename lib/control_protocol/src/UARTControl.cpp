@@ -0,0 +1,113 @@
+
+#include "UARTControl.h"
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+static const char *TAG = "CTRL";
+
+// size of the driver's receive ring buffer
+static const int UART_RX_BUFFER_SIZE = 1024;
+static const int UART_TX_BUFFER_SIZE = 256;
+static const int UART_EVENT_QUEUE_SIZE = 20;
+// raise a data event after this many idle symbol times rather than waiting for the fifo to fill
+static const int UART_RX_TIMEOUT = 2;
+
+UARTControl::UARTControl(uart_port_t uart_port, gpio_num_t tx, gpio_num_t rx, int baud_rate,
+                         QueueHandle_t command_queue, void (*get_status)(audio_status_t *status))
+    : m_uart_port(uart_port), m_command_queue(command_queue), m_get_status(get_status)
+{
+  uart_config_t uart_config = {
+      .baud_rate = baud_rate,
+      .data_bits = UART_DATA_8_BITS,
+      .parity = UART_PARITY_DISABLE,
+      .stop_bits = UART_STOP_BITS_1,
+      .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+      .rx_flow_ctrl_thresh = 0,
+      .source_clk = UART_SCLK_DEFAULT};
+  esp_err_t ret = uart_driver_install(m_uart_port, UART_RX_BUFFER_SIZE, UART_TX_BUFFER_SIZE, UART_EVENT_QUEUE_SIZE, &m_uart_queue, 0);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to install UART driver (%s)", esp_err_to_name(ret));
+    return;
+  }
+  uart_param_config(m_uart_port, &uart_config);
+  uart_set_pin(m_uart_port, tx, rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+  uart_set_rx_timeout(m_uart_port, UART_RX_TIMEOUT);
+  xTaskCreate(task, "uart_control_task", 3072, this, 6, NULL);
+  ESP_LOGI(TAG, "Listening for commands on UART%d at %d baud", m_uart_port, baud_rate);
+}
+
+void UARTControl::task(void *param)
+{
+  static_cast<UARTControl *>(param)->run();
+}
+
+void UARTControl::run()
+{
+  uart_event_t event;
+  while (1)
+  {
+    if (xQueueReceive(m_uart_queue, &event, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    switch (event.type)
+    {
+    case UART_DATA:
+    {
+      int remaining = event.size;
+      while (remaining > 0)
+      {
+        int to_read = remaining < (int)sizeof(m_rx_buffer) ? remaining : sizeof(m_rx_buffer);
+        int read = uart_read_bytes(m_uart_port, m_rx_buffer, to_read, 0);
+        if (read <= 0)
+        {
+          break;
+        }
+        // timestamp the whole read - the bytes arrived within one rx timeout of each other
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < read; i++)
+        {
+          m_parser.feed(m_rx_buffer[i]);
+          audio_command_t command;
+          while (m_parser.next(command))
+          {
+            command.received_us = now;
+            handle(command);
+          }
+        }
+        remaining -= read;
+      }
+      break;
+    }
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+      ESP_LOGW(TAG, "UART receive overflow");
+      uart_flush_input(m_uart_port);
+      xQueueReset(m_uart_queue);
+      m_parser.reset();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void UARTControl::handle(audio_command_t &command)
+{
+  if (command.type == AUDIO_CMD_STATUS)
+  {
+    audio_status_t status;
+    m_get_status(&status);
+    uint8_t frame[CONTROL_STATUS_FRAME_SIZE];
+    int length = ControlParser::encode_status(status, frame);
+    uart_write_bytes(m_uart_port, frame, length);
+    return;
+  }
+  if (xQueueSend(m_command_queue, &command, 0) != pdTRUE)
+  {
+    m_dropped++;
+    ESP_LOGW(TAG, "Command queue full, dropped %d commands", m_dropped);
+  }
+}
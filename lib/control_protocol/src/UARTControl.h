@@ -0,0 +1,31 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <driver/uart.h>
+#include "ControlParser.h"
+
+/**
+ * Receives control frames on a UART and pushes the decoded commands onto the
+ * audio engine's command queue. Status requests are answered directly.
+ **/
+class UARTControl
+{
+private:
+  uart_port_t m_uart_port;
+  // events from the UART driver
+  QueueHandle_t m_uart_queue;
+  QueueHandle_t m_command_queue;
+  void (*m_get_status)(audio_status_t *status);
+  ControlParser m_parser;
+  uint8_t m_rx_buffer[128];
+  int m_dropped = 0;
+
+  static void task(void *param);
+  void run();
+  void handle(audio_command_t &command);
+
+public:
+  UARTControl(uart_port_t uart_port, gpio_num_t tx, gpio_num_t rx, int baud_rate,
+              QueueHandle_t command_queue, void (*get_status)(audio_status_t *status));
+};
@@ -0,0 +1,192 @@
+
+#include "InputEvents.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+
+static const char *TAG = "INPUT";
+
+// the GPIO ISR gets the pin it fired for through its argument
+struct PinRef
+{
+  InputEvents *inputs;
+  uint8_t index;
+};
+static PinRef pin_refs[MAX_INPUT_PINS];
+
+InputEvents::InputEvents(int debounce_ms, input_handler_t handler, void *handler_arg)
+    : m_debounce_us(debounce_ms * 1000), m_handler(handler), m_handler_arg(handler_arg)
+{
+  gpio_install_isr_service(0);
+
+  gptimer_config_t timer_config = {
+      .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+      .direction = GPTIMER_COUNT_UP,
+      .resolution_hz = 1000000};
+  if (gptimer_new_timer(&timer_config, &m_timer) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to create debounce timer");
+    return;
+  }
+  gptimer_event_callbacks_t callbacks = {.on_alarm = timer_isr};
+  gptimer_register_event_callbacks(m_timer, &callbacks, this);
+  // the timer only runs while a pin is bouncing, the first edge starts it
+  gptimer_enable(m_timer);
+}
+
+int InputEvents::add_pin(gpio_num_t gpio, bool active_high)
+{
+  if (m_pin_count >= MAX_INPUT_PINS)
+  {
+    ESP_LOGE(TAG, "Too many input pins");
+    return -1;
+  }
+  int index = m_pin_count;
+  gpio_set_direction(gpio, GPIO_MODE_INPUT);
+  gpio_set_pull_mode(gpio, active_high ? GPIO_PULLDOWN_ONLY : GPIO_PULLUP_ONLY);
+  int level = gpio_get_level(gpio);
+  m_pins[index] = {gpio, active_high, level, level, false, 0, 0};
+  pin_refs[index] = {this, (uint8_t)index};
+  // publish the pin before its interrupt can fire
+  __atomic_store_n(&m_pin_count, index + 1, __ATOMIC_RELEASE);
+  gpio_set_intr_type(gpio, GPIO_INTR_ANYEDGE);
+  gpio_isr_handler_add(gpio, gpio_isr, &pin_refs[index]);
+  return index;
+}
+
+void IRAM_ATTR InputEvents::gpio_isr(void *arg)
+{
+  PinRef *ref = (PinRef *)arg;
+  InputEvents *inputs = ref->inputs;
+  inputs->push_edge(ref->index);
+  portENTER_CRITICAL_ISR(&inputs->m_timer_lock);
+  if (!inputs->m_timer_running && inputs->m_timer)
+  {
+    inputs->arm_timer(inputs->m_debounce_us);
+  }
+  portEXIT_CRITICAL_ISR(&inputs->m_timer_lock);
+}
+
+void IRAM_ATTR InputEvents::push_edge(uint8_t index)
+{
+  uint32_t head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+  uint32_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= INPUT_RING_SIZE)
+  {
+    // the captured level of this pin is now stale, the timer reads it once the pin settles
+    __atomic_fetch_or(&m_dropped, 1u << index, __ATOMIC_RELEASE);
+    return;
+  }
+  Edge &edge = m_ring[head & (INPUT_RING_SIZE - 1)];
+  edge.index = index;
+  edge.level = gpio_get_level(m_pins[index].gpio);
+  edge.time_us = esp_timer_get_time();
+  __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// called with m_timer_lock held
+void IRAM_ATTR InputEvents::arm_timer(int64_t delay_us)
+{
+  gptimer_alarm_config_t alarm_config = {
+      .alarm_count = (uint64_t)delay_us,
+      .reload_count = 0,
+      .flags = {.auto_reload_on_alarm = false}};
+  gptimer_set_raw_count(m_timer, 0);
+  gptimer_set_alarm_action(m_timer, &alarm_config);
+  if (!m_timer_running)
+  {
+    gptimer_start(m_timer);
+    m_timer_running = true;
+  }
+}
+
+bool IRAM_ATTR InputEvents::timer_isr(gptimer_handle_t timer, const gptimer_alarm_event_data_t *event, void *arg)
+{
+  return static_cast<InputEvents *>(arg)->debounce();
+}
+
+bool IRAM_ATTR InputEvents::debounce()
+{
+  // move the raw edges into the per pin state machines
+  uint32_t tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+  uint32_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+  for (; tail != head; tail++)
+  {
+    const Edge &edge = m_ring[tail & (INPUT_RING_SIZE - 1)];
+    Pin &pin = m_pins[edge.index];
+    if (!pin.bouncing)
+    {
+      pin.bouncing = true;
+      pin.first_edge_us = edge.time_us;
+    }
+    pin.last_edge_us = edge.time_us;
+    pin.last_level = edge.level;
+  }
+  __atomic_store_n(&m_tail, tail, __ATOMIC_RELEASE);
+
+  // pins that lost edges wait a full debounce time from now and then read the pin
+  int64_t now = esp_timer_get_time();
+  uint32_t dropped = __atomic_exchange_n(&m_dropped, 0, __ATOMIC_ACQUIRE);
+  for (int i = 0; dropped; i++, dropped >>= 1)
+  {
+    if (dropped & 1)
+    {
+      Pin &pin = m_pins[i];
+      if (!pin.bouncing)
+      {
+        pin.bouncing = true;
+        pin.first_edge_us = now;
+      }
+      pin.last_edge_us = now;
+      pin.last_level = -1;
+    }
+  }
+
+  // report the pins that have been quiet for the debounce time and changed level
+  BaseType_t woken = pdFALSE;
+  int64_t next_us = INT64_MAX;
+  int pin_count = __atomic_load_n(&m_pin_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < pin_count; i++)
+  {
+    Pin &pin = m_pins[i];
+    if (!pin.bouncing)
+    {
+      continue;
+    }
+    int64_t remaining_us = pin.last_edge_us + m_debounce_us - now;
+    if (remaining_us > 0)
+    {
+      next_us = remaining_us < next_us ? remaining_us : next_us;
+      continue;
+    }
+    pin.bouncing = false;
+    int level = pin.last_level >= 0 ? pin.last_level : gpio_get_level(pin.gpio);
+    if (level == pin.stable_level)
+    {
+      // just a glitch
+      continue;
+    }
+    pin.stable_level = level;
+    input_event_t event = {(uint8_t)i, pin.gpio, (level != 0) == pin.active_high, pin.first_edge_us};
+    m_handler(&event, m_handler_arg, &woken);
+  }
+
+  // re-arm for the next pin due to settle, or stop if nothing is left. Edges that
+  // arrived since the drain find the timer running and are picked up next time
+  portENTER_CRITICAL_ISR(&m_timer_lock);
+  if (__atomic_load_n(&m_head, __ATOMIC_ACQUIRE) != tail || __atomic_load_n(&m_dropped, __ATOMIC_ACQUIRE))
+  {
+    next_us = next_us < m_debounce_us ? next_us : m_debounce_us;
+  }
+  if (next_us == INT64_MAX)
+  {
+    gptimer_stop(m_timer);
+    m_timer_running = false;
+  }
+  else
+  {
+    arm_timer(next_us > INPUT_MIN_ALARM_US ? next_us : INPUT_MIN_ALARM_US);
+  }
+  portEXIT_CRITICAL_ISR(&m_timer_lock);
+  return woken == pdTRUE;
+}
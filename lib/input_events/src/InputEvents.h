@@ -0,0 +1,84 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <driver/gpio.h>
+#include <driver/gptimer.h>
+
+// most pins one InputEvents can watch
+#define MAX_INPUT_PINS 16
+// raw edges that can be waiting for the debounce timer, must be a power of two
+#define INPUT_RING_SIZE 64
+// shortest one shot alarm, so a pin that is nearly settled doesn't get a storm of alarms
+#define INPUT_MIN_ALARM_US 100
+
+// a debounced change on one of the pins
+typedef struct
+{
+  // index of the pin in the order it was added
+  uint8_t index;
+  gpio_num_t gpio;
+  bool pressed;
+  // esp_timer time of the first edge of the change, before any debounce delay
+  int64_t time_us;
+} input_event_t;
+
+// called from the debounce timer ISR, set *woken if a higher priority task was woken
+typedef void (*input_handler_t)(const input_event_t *event, void *arg, BaseType_t *woken);
+
+/**
+ * Timestamped, debounced GPIO inputs without any tasks. The GPIO ISR records
+ * the time and level of every edge in a lock free ring, and a one shot hardware
+ * timer runs a debounce state machine per pin. The first edge arms the timer,
+ * which re-arms itself for the next pin due to settle and stops once nothing is
+ * bouncing, so an idle button costs no interrupts. Once a pin has been stable
+ * for the debounce time the handler gets the change with the time of its first
+ * edge and the level of its last one.
+ **/
+class InputEvents
+{
+private:
+  struct Pin
+  {
+    gpio_num_t gpio;
+    bool active_high;
+    int stable_level;
+    // level captured by the last edge, -1 if edges were dropped and it has to be read
+    int last_level;
+    bool bouncing;
+    int64_t first_edge_us;
+    int64_t last_edge_us;
+  };
+  struct Edge
+  {
+    uint8_t index;
+    uint8_t level;
+    int64_t time_us;
+  };
+
+  Pin m_pins[MAX_INPUT_PINS];
+  int m_pin_count = 0;
+  // single producer (GPIO ISR) single consumer (timer ISR) ring of raw edges
+  Edge m_ring[INPUT_RING_SIZE];
+  uint32_t m_head = 0;
+  uint32_t m_tail = 0;
+  // pins that lost edges because the ring was full
+  uint32_t m_dropped = 0;
+  int m_debounce_us;
+  gptimer_handle_t m_timer = nullptr;
+  // guards starting and stopping the timer between the GPIO and timer ISRs
+  portMUX_TYPE m_timer_lock = portMUX_INITIALIZER_UNLOCKED;
+  bool m_timer_running = false;
+  input_handler_t m_handler;
+  void *m_handler_arg;
+
+  static void gpio_isr(void *arg);
+  static bool timer_isr(gptimer_handle_t timer, const gptimer_alarm_event_data_t *event, void *arg);
+  void push_edge(uint8_t index);
+  void arm_timer(int64_t delay_us);
+  bool debounce();
+
+public:
+  InputEvents(int debounce_ms, input_handler_t handler, void *handler_arg = nullptr);
+  // returns the index of the pin or -1 if there is no room
+  int add_pin(gpio_num_t gpio, bool active_high);
+};
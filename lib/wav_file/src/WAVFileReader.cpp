@@ -1,28 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
 #include "esp_log.h"
 #include "WAVFileReader.h"
 
 static const char *TAG = "WAV";
 
+// the fields of the fmt chunk we care about, from audio_format to bit_depth
+static const int FMT_FIELDS_SIZE = 16;
+// the fmt chunk extension holds samples per block for IMA ADPCM
+static const int FMT_ADPCM_SIZE = 20;
+// smpl chunk header before the loop list, and the size of each loop entry
+static const int SMPL_HEADER_SIZE = 36;
+static const int SMPL_LOOP_SIZE = 24;
+
 WAVFileReader::WAVFileReader(FILE *fp)
 {
     m_fp = fp;
-    // read the WAV header
-    fread((void *)&m_wav_header, sizeof(wav_header_t), 1, m_fp);
-    // sanity check the bit depth
+    // read the RIFF header
+    fread((void *)&m_wav_header, 12, 1, m_fp);
+    // walk the chunks - the fmt and data chunks are not always at fixed offsets
+    // and the smpl chunk with the loop points usually comes after the data
+    char chunk_id[4];
+    uint32_t chunk_size;
+    while (fread(chunk_id, 4, 1, m_fp) == 1 && fread(&chunk_size, 4, 1, m_fp) == 1)
+    {
+        long chunk_start = ftell(m_fp);
+        if (memcmp(chunk_id, "fmt ", 4) == 0)
+        {
+            read_fmt_chunk(chunk_size);
+        }
+        else if (memcmp(chunk_id, "data", 4) == 0)
+        {
+            m_data_offset = chunk_start;
+            m_wav_header.data_bytes = chunk_size;
+        }
+        else if (memcmp(chunk_id, "smpl", 4) == 0)
+        {
+            read_smpl_chunk(chunk_size);
+        }
+        else if (memcmp(chunk_id, "seek", 4) == 0)
+        {
+            read_seek_chunk(chunk_size);
+        }
+        // chunks are padded to an even number of bytes
+        if (fseek(m_fp, chunk_start + chunk_size + (chunk_size & 1), SEEK_SET) != 0)
+        {
+            break;
+        }
+    }
+    if (m_data_offset == 0)
+    {
+        ESP_LOGE(TAG, "ERROR: no data chunk found\n");
+    }
+    fseek(m_fp, m_data_offset, SEEK_SET);
+    // sanity check the format
+    if (m_wav_header.audio_format != WAV_FORMAT_PCM)
+    {
+        // the seek maths handles block based formats but there is no decoder for them
+        ESP_LOGE(TAG, "ERROR: audio format %d is not supported\n", m_wav_header.audio_format);
+    }
     if (m_wav_header.bit_depth != 16)
     {
         ESP_LOGE(TAG, "ERROR: bit depth %d is not supported\n", m_wav_header.bit_depth);
     }
-    if (m_wav_header.num_channels != 1)
+    if (m_wav_header.num_channels != 1 && m_wav_header.num_channels != 2)
     {
         ESP_LOGE(TAG, "ERROR: channels %d is not supported\n", m_wav_header.num_channels);
+        // don't play anything rather than playing garbage
+        m_wav_header.num_channels = 1;
+        m_wav_header.data_bytes = 0;
+    }
+    if (m_wav_header.sample_alignment <= 0)
+    {
+        m_wav_header.sample_alignment = sizeof(int16_t) * m_wav_header.num_channels;
+    }
+    // the seek chunk may also come first - only trust a table that is sorted and stays inside the data.
+    // With one frame per block (PCM, float) the offset of a frame is exact, so each entry must match it;
+    // block formats like IMA ADPCM only get the sorted, aligned and in range checks
+    for (int i = 0; i < m_seek_entries; i++)
+    {
+        const wav_seek_entry_t &entry = m_seek_table[i];
+        bool sorted = i == 0 || (entry.frame > m_seek_table[i - 1].frame && entry.offset > m_seek_table[i - 1].offset);
+        bool matches = m_frames_per_block != 1 || entry.offset == entry.frame * (uint32_t)m_wav_header.sample_alignment;
+        if (!sorted || !matches || entry.offset >= (uint32_t)m_wav_header.data_bytes || entry.offset % m_wav_header.sample_alignment != 0 ||
+            entry.frame > (uint32_t)num_frames())
+        {
+            ESP_LOGW(TAG, "Ignoring invalid seek table, entry %d is %u at %u\n", i, (unsigned)entry.frame, (unsigned)entry.offset);
+            free(m_seek_table);
+            m_seek_table = nullptr;
+            m_seek_entries = 0;
+            break;
+        }
+    }
+    // the smpl chunk may come before the data chunk so check the loop once we know the length
+    if (m_loop_end != 0)
+    {
+        if (m_loop_start < 0 || m_loop_end <= m_loop_start || m_loop_end > num_frames())
+        {
+            ESP_LOGW(TAG, "Ignoring invalid loop %d-%d\n", m_loop_start, m_loop_end);
+            m_loop_start = m_loop_end = 0;
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Loop from frame %d to %d\n", m_loop_start, m_loop_end);
+        }
     }
     ESP_LOGI(TAG, "fmt_chunk_size=%d, audio_format=%d, num_channels=%d, sample_rate=%d, sample_alignment=%d, bit_depth=%d, data_bytes=%d\n",
              m_wav_header.fmt_chunk_size, m_wav_header.audio_format, m_wav_header.num_channels, m_wav_header.sample_rate, m_wav_header.sample_alignment, m_wav_header.bit_depth, m_wav_header.data_bytes);
 }
 
-int WAVFileReader::read(int16_t *samples, int count)
+WAVFileReader::~WAVFileReader()
+{
+    free(m_seek_table);
+}
+
+void WAVFileReader::read_fmt_chunk(int size)
+{
+    m_wav_header.fmt_chunk_size = size;
+    fread((void *)&m_wav_header.audio_format, FMT_FIELDS_SIZE, 1, m_fp);
+    if (m_wav_header.audio_format == WAV_FORMAT_IMA_ADPCM && size >= FMT_ADPCM_SIZE)
+    {
+        // skip cbSize, then wSamplesPerBlock
+        uint16_t extension[2];
+        if (fread(extension, sizeof(extension), 1, m_fp) == 1 && extension[1] > 0)
+        {
+            m_frames_per_block = extension[1];
+        }
+    }
+}
+
+void WAVFileReader::read_smpl_chunk(int size)
+{
+    uint8_t header[SMPL_HEADER_SIZE];
+    if (size < SMPL_HEADER_SIZE + SMPL_LOOP_SIZE || fread(header, SMPL_HEADER_SIZE, 1, m_fp) != 1)
+    {
+        return;
+    }
+    uint32_t num_loops;
+    memcpy(&num_loops, header + 28, 4);
+    if (num_loops == 0)
+    {
+        return;
+    }
+    // only the first loop is used - cue id, type, start, end (inclusive), fraction, play count
+    uint32_t loop[6];
+    if (fread(loop, SMPL_LOOP_SIZE, 1, m_fp) != 1)
+    {
+        return;
+    }
+    m_loop_start = loop[2];
+    m_loop_end = loop[3] + 1;
+}
+
+void WAVFileReader::read_seek_chunk(int size)
 {
-    size_t read = fread(samples, sizeof(int16_t), count, m_fp);
+    int entries = size / sizeof(wav_seek_entry_t);
+    if (entries > MAX_SEEK_ENTRIES)
+    {
+        entries = MAX_SEEK_ENTRIES;
+    }
+    if (entries == 0)
+    {
+        return;
+    }
+    m_seek_table = (wav_seek_entry_t *)malloc(entries * sizeof(wav_seek_entry_t));
+    if (!m_seek_table)
+    {
+        return;
+    }
+    m_seek_entries = fread(m_seek_table, sizeof(wav_seek_entry_t), entries, m_fp);
+    ESP_LOGI(TAG, "Seek table with %d entries\n", m_seek_entries);
+}
+
+int WAVFileReader::seek(int frame)
+{
+    if (frame < 0)
+    {
+        frame = 0;
+    }
+    if (frame > num_frames())
+    {
+        frame = num_frames();
+    }
+    // start from the closest seek table entry at or before the frame, if there is a table
+    uint32_t base_frame = 0;
+    uint32_t base_offset = 0;
+    int low = 0, high = m_seek_entries - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (m_seek_table[mid].frame <= (uint32_t)frame)
+        {
+            base_frame = m_seek_table[mid].frame;
+            base_offset = m_seek_table[mid].offset;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    // then step whole blocks from there
+    int blocks = (frame - base_frame) / m_frames_per_block;
+    m_position = base_frame + blocks * m_frames_per_block;
+    fseek(m_fp, m_data_offset + base_offset + (long)blocks * m_wav_header.sample_alignment, SEEK_SET);
+    return m_position;
+}
+
+int WAVFileReader::seek_ms(uint32_t ms)
+{
+    return seek((int64_t)ms * m_wav_header.sample_rate / 1000);
+}
+
+int WAVFileReader::read(int16_t *frames, int count)
+{
+    // don't read past the data chunk into any trailing chunks
+    if (count > num_frames() - m_position)
+    {
+        count = num_frames() - m_position;
+    }
+    size_t read = fread(frames, sizeof(int16_t) * m_wav_header.num_channels, count, m_fp);
+    m_position += read;
+    return read;
+}
+
+int WAVFileReader::read_raw(void *data, int count)
+{
+    if (count > num_frames() - m_position)
+    {
+        count = num_frames() - m_position;
+    }
+    size_t read = fread(data, m_wav_header.sample_alignment, count, m_fp);
+    m_position += read;
     return read;
 }
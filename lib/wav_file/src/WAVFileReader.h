@@ -2,6 +2,25 @@
 
 #include "WAVFile.h"
 #include <stdio.h>
+#include <stdint.h>
+
+// audio_format values from the fmt chunk
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+#define WAV_FORMAT_IMA_ADPCM 0x11
+
+// most entries kept from an optional "seek" chunk
+#define MAX_SEEK_ENTRIES 256
+
+// one entry of the optional "seek" chunk - a frame that starts a block and
+// the byte offset of that block from the start of the data chunk. For PCM the
+// offset must be exactly frame * sample_alignment, entries for block formats
+// are only checked for order and range
+typedef struct
+{
+    uint32_t frame;
+    uint32_t offset;
+} wav_seek_entry_t;
 
 class WAVFileReader
 {
@@ -9,9 +28,43 @@ private:
     wav_header_t m_wav_header;
 
     FILE *m_fp;
+    // byte offset of the first sample in the data chunk
+    long m_data_offset = 0;
+    // frames in each block of sample_alignment bytes - 1 for PCM, more for ADPCM
+    int m_frames_per_block = 1;
+    // coarse seek table from the "seek" chunk, null if the file doesn't have one
+    wav_seek_entry_t *m_seek_table = nullptr;
+    int m_seek_entries = 0;
+    // next frame to be read - a frame is one sample for each channel
+    int m_position = 0;
+    // loop region in frames from the smpl chunk - m_loop_end is exclusive and 0 if there is no loop
+    int m_loop_start = 0;
+    int m_loop_end = 0;
+
+    void read_fmt_chunk(int size);
+    void read_smpl_chunk(int size);
+    void read_seek_chunk(int size);
 
 public:
     WAVFileReader(FILE *fp);
+    ~WAVFileReader();
     int sample_rate() { return m_wav_header.sample_rate; }
-    int read(int16_t *samples, int count);
+    int channels() { return m_wav_header.num_channels; }
+    int audio_format() { return m_wav_header.audio_format; }
+    int bit_depth() { return m_wav_header.bit_depth; }
+    int sample_alignment() { return m_wav_header.sample_alignment; }
+    int num_frames() { return m_wav_header.data_bytes / m_wav_header.sample_alignment * m_frames_per_block; }
+    bool has_loop() { return m_loop_end > m_loop_start; }
+    int loop_start() { return m_loop_start; }
+    int loop_end() { return m_loop_end; }
+    int position() { return m_position; }
+    // move the read position to the start of the block holding the given
+    // frame, returns the frame actually landed on - always exact for PCM
+    int seek(int frame);
+    int seek_ms(uint32_t ms);
+    // read up to count interleaved frames, returns the number of frames read
+    int read(int16_t *frames, int count);
+    // read up to count frames as they are stored in the file, for formats that
+    // read() can't play directly - returns the number of frames read
+    int read_raw(void *data, int count);
 };
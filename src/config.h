@@ -1,5 +1,6 @@
 #include <freertos/FreeRTOS.h>
 #include <driver/i2s.h>
+#include <driver/uart.h>
 
 // save to SPIFFS instead of SD Card?
 // #define USE_SPIFFS 1
@@ -23,9 +24,23 @@
 #define I2S_SPEAKER_LEFT_RIGHT_CLOCK GPIO_NUM_13
 #define I2S_SPEAKER_SERIAL_DATA GPIO_NUM_14
 
+// also send the mix to the built-in DAC (GPIO25) - comment this out to only use the PCM5102
+// #define USE_DAC_OUTPUT
+// the built-in DAC only works on I2S_NUM_0, so the PCM5102 moves to I2S_NUM_1 when both are used
+#ifdef USE_DAC_OUTPUT
+#define I2S_SPEAKER_PORT I2S_NUM_1
+#else
+#define I2S_SPEAKER_PORT I2S_NUM_0
+#endif
+
 // button
 #define GPIO_BUTTON GPIO_NUM_23
 #define GPIO_BUTTON_1 GPIO_NUM_22
+// control protocol UART for an external host controller
+#define CONTROL_UART_NUM UART_NUM_2
+#define CONTROL_UART_TX GPIO_NUM_33
+#define CONTROL_UART_RX GPIO_NUM_32
+#define CONTROL_UART_BAUD 921600
 // sdcard
 #define PIN_NUM_MISO GPIO_NUM_16
 #define PIN_NUM_CLK GPIO_NUM_18
@@ -1,15 +1,27 @@
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
-#include "freertos/timers.h"
 #include "driver/i2s.h"
 #include "driver/gpio.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 #include <dirent.h>
 #include <string.h>
 #include "I2SOutput.h"
+#include "DACOutput.h"
+#include "OutputRouter.h"
+#include "Mixer.h"
+#include "Voice.h"
+#include "AudioCommand.h"
+#include "UARTControl.h"
+#include "InputEvents.h"
+#include "AssetCache.h"
 #include "SDCard.h"
 #include "SPIFFS.h"
 #include "WAVFileReader.h"
@@ -21,175 +33,465 @@ extern "C" {
 }
 
 /*Task:
-+ audio_processing_task: Đọc file WAV, mix âm thanh, gửi dữ liệu vào queue.
-+ i2s_output_task: Lấy dữ liệu từ queue và phát qua I2S.
-+ button_task: Xử lý sự kiện nút bấm qua ISR.
++ audio_processing_task: Đọc file WAV, mix âm thanh, gửi dữ liệu vào queue. Sau SILENCE_HOLD_MS im lặng thì chuyển sang idle.
++ i2s_output_task: Lấy dữ liệu từ queue và phát qua OutputRouter tới tất cả các output (I2S, DAC).
++ Nút bấm không cần task: ISR ghi thời điểm cạnh, timer phần cứng debounce (InputEvents) rồi gửi lệnh vào command_queue.
++ uart_control_task: Nhận lệnh nhị phân qua UART (UARTControl), gửi vào command_queue.
++ asset_cache_task: Ưu tiên thấp nhất, chuyển file WAV mới/thay đổi sang định dạng gốc của pipeline trong CACHE_DIR (AssetCache).
 */
 // Định nghĩa hằng số
 #define SAMPLE_RATE 44100
-#define BUFFER_SIZE 1024
-#define QUEUE_SIZE 20 // Tăng kích thước queue để giảm underrun
-#define DEBOUNCE_TIME_MS 500 //Thời gian debounce (500ms) để loại bỏ nhiễu khi nhấn nút.
+#define BUFFER_SIZE 1024 // Số frame trong một block
+#define CHANNELS 2 // Pipeline stereo xen kẽ (L R L R ...), nguồn mono được pan trong mixer
+#define BLOCK_SAMPLES (BUFFER_SIZE * CHANNELS)
+#define QUEUE_SIZE 10 // ~230ms buffer; mỗi block stereo 4KB nên giữ RAM như queue mono 20 block cũ
+#define INPUT_DEBOUNCE_MS 20 //Chân phải ổn định 20ms mới được coi là một lần nhấn.
+#define INPUT_LATENCY_MS 80 //Nút bấm được nghe 80ms (+ DMA I2S) sau lúc nhấn; phải lớn hơn debounce + 1 block chờ lệnh + ring của OutputRouter.
+#define SILENCE_HOLD_MS 2000 //Sau 2s im lặng liên tục engine chuyển sang chế độ idle.
+#define COMMAND_QUEUE_SIZE 32 //Số lệnh (nút bấm, UART) chờ engine xử lý.
+#define MAX_PENDING_COMMANDS 16 //Số lệnh có timestamp chờ tới thời điểm áp dụng.
+#define COMMAND_LOG_SIZE 64 //Số lệnh đã áp dụng được nhớ để phát lại khi xả audio_queue (lũy thừa của 2).
+#define CACHE_DIR "/sdcard/_cache" //File đã chuyển sang SAMPLE_RATE/CHANNELS/16 bit (tên 8.3 vì LFN tắt).
 
 // Biến toàn cục FreeRTOS
 static QueueHandle_t audio_queue;
+static QueueHandle_t command_queue; //Lệnh audio_command_t từ nút bấm và UART tới engine.
 static EventGroupHandle_t event_group; //EventGroup để đồng bộ hóa trạng thái (phát, mix, dừng).
-static TimerHandle_t debounce_timer; //Timer phần mềm để debounce nút bấm.
+static OutputRouter *output_router; //Chia bản mix cho tất cả các output.
+static AssetCache *asset_cache; //Bản đã chuyển định dạng của các file trên thẻ SD.
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t pm_lock; //Giữ xung CPU tối đa khi đang phát, nhả ra khi idle.
+#endif
 
-// Event Bits
+// Event Bits - BIT_MUSIC_PLAYING/BIT_MIX_REQUESTED do engine cập nhật theo voice đang phát
 #define BIT_MUSIC_PLAYING (1 << 0)
 #define BIT_MIX_REQUESTED (1 << 1)
-#define BIT_BUTTON_PLAY (1 << 2)
-#define BIT_BUTTON_MIX (1 << 3)
-#define BIT_STOP_REQUESTED (1 << 4)
-
-// ISR cho nút bấm
-/*   ISR (Interrupt Service Routine)
-Phản ứng nhanh với sự kiện phần cứng (như nhấn nút) mà không cần thăm dò (polling) liên tục, tiết kiệm CPU.
-IRAM (Internal RAM) 
-ISR tiêu tốn IRAM, giới hạn trên ESP32 (128 KB IRAM).
-*/
-void IRAM_ATTR button_play_isr_handler(void *arg) {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    xEventGroupSetBitsFromISR(event_group, BIT_BUTTON_PLAY, &xHigherPriorityTaskWoken);
-    if (xHigherPriorityTaskWoken) {
-        portYIELD_FROM_ISR();
+
+// Thứ tự các chân trong InputEvents
+#define INPUT_PLAY 0
+#define INPUT_MIX 1
+
+// Chế độ idle: cho phép DFS hạ xung CPU khi không có âm thanh
+static void engine_sleep() {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_release(pm_lock);
+#endif
+}
+
+static void engine_wake() {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(pm_lock);
+#endif
+}
+
+// Trạng thái engine - chỉ audio_processing_task được thay đổi
+static FILE *voice_fp[NUM_VOICES];
+static WAVFileReader *voice_reader[NUM_VOICES];
+static Voice<CHANNELS> *voices[NUM_VOICES];
+static bool voice_active[NUM_VOICES];
+static int voice_gain[NUM_VOICES] = {GAIN_UNITY, GAIN_UNITY};
+static const char *voice_files[NUM_VOICES] = {"/sdcard/gong.wav", "/sdcard/huh.wav"};
+static int sample_rate = SAMPLE_RATE;
+// Đồng hồ mẫu: số frame đã render, dùng cho timestamp của lệnh
+static volatile uint32_t sample_clock = 0;
+static volatile uint32_t max_latency_us = 0;
+// Lệnh có timestamp trong tương lai chờ ở đây (mảng cố định, không cấp phát)
+static audio_command_t pending_commands[MAX_PENDING_COMMANDS];
+static int pending_count = 0;
+// Trạng thái voice ở đầu mỗi block đã gửi, để render lại từ đó khi xả audio_queue
+typedef struct {
+    uint32_t clock;
+    int position[NUM_VOICES];
+    bool active[NUM_VOICES];
+    int gain[NUM_VOICES];
+    // command_log_count lúc lưu checkpoint: các lệnh từ đây trở đi được phát lại khi quay về checkpoint này
+    uint32_t log_index;
+} render_checkpoint_t;
+static render_checkpoint_t checkpoints[QUEUE_SIZE + 1];
+static uint32_t blocks_sent = 0;
+// Mọi lệnh đã áp dụng cùng mẫu áp dụng, vòng tròn COMMAND_LOG_SIZE phần tử
+typedef struct {
+    audio_command_t cmd;
+    uint32_t sample;
+} logged_command_t;
+static logged_command_t command_log[COMMAND_LOG_SIZE];
+static uint32_t command_log_count = 0;
+// Mẫu của lệnh phát lại cuối cùng: lệnh không timestamp nhận sau khi xả không được chạy trước nó
+static uint32_t replayed_until = 0;
+
+static bool open_voices() {
+    // Giữ lock trong lúc file mở để AssetCache không thay file cache đang phát
+    asset_cache->lock();
+    char cached_path[64];
+    for (int v = 0; v < NUM_VOICES; v++) {
+        // Dùng bản cache nếu còn mới: khi đó mixer chỉ copy và trộn, không phải chuyển đổi
+        const char *path = asset_cache->resolve(voice_files[v], cached_path, sizeof(cached_path));
+        ESP_LOGI(TAG, "Voice %d: %s", v, path);
+        voice_fp[v] = fopen(path, "rb");
+        if (!voice_fp[v]) {
+            ESP_LOGE(TAG, "Cannot open %s", path);
+            for (int i = 0; i < v; i++) {
+                delete voices[i]; delete voice_reader[i]; fclose(voice_fp[i]);
+                voices[i] = NULL;
+            }
+            asset_cache->unlock();
+            return false;
+        }
+        voice_reader[v] = new WAVFileReader(voice_fp[v]);
+        // Voice tự lặp nếu file có chunk smpl, vòng lặp ngắn được giữ trong RAM
+        voices[v] = new Voice<CHANNELS>(voice_reader[v]);
+        voices[v]->set_gain(voice_gain[v]);
+    }
+    sample_rate = voice_reader[VOICE_MAIN]->sample_rate();
+    ESP_LOGI(TAG, "Sample rate: %d", sample_rate);
+    output_router->start(sample_rate);
+    return true;
+}
+
+static void close_voices() {
+    bool was_open = voices[VOICE_MAIN] != NULL;
+    for (int v = 0; v < NUM_VOICES; v++) {
+        if (voices[v]) {
+            delete voices[v]; delete voice_reader[v]; fclose(voice_fp[v]);
+            voices[v] = NULL;
+        }
+        voice_active[v] = false;
+    }
+    if (was_open) {
+        asset_cache->unlock();
+    }
+}
+
+// Cập nhật event bits để handler nút bấm biết trạng thái
+static void publish_state() {
+    EventBits_t bits = 0;
+    if (voice_active[VOICE_MAIN]) bits |= BIT_MUSIC_PLAYING;
+    if (voice_active[VOICE_MIX]) bits |= BIT_MIX_REQUESTED;
+    xEventGroupClearBits(event_group, ~bits & (BIT_MUSIC_PLAYING | BIT_MIX_REQUESTED));
+    xEventGroupSetBits(event_group, bits);
+}
+
+// Áp dụng lệnh tại mẫu sample và ghi vào command_log để có thể phát lại nếu block chứa mẫu đó bị xả
+static void apply_command(const audio_command_t &cmd, uint32_t sample) {
+    if (cmd.received_us && !cmd.timestamp) {
+        uint32_t latency = esp_timer_get_time() - cmd.received_us;
+        if (latency > max_latency_us) max_latency_us = latency;
+    }
+    command_log[command_log_count++ & (COMMAND_LOG_SIZE - 1)] = {cmd, sample};
+    switch (cmd.type) {
+    case AUDIO_CMD_TRIGGER:
+        if (!voices[cmd.voice] && !open_voices()) break;
+        voices[cmd.voice]->restart();
+        voice_active[cmd.voice] = true;
+        break;
+    case AUDIO_CMD_STOP:
+        voice_active[cmd.voice] = false;
+        break;
+    case AUDIO_CMD_SEEK:
+        if (!voices[cmd.voice] && !open_voices()) break;
+        voices[cmd.voice]->seek(cmd.position);
+        voice_active[cmd.voice] = true;
+        break;
+    case AUDIO_CMD_GAIN:
+        voice_gain[cmd.voice] = cmd.gain;
+        if (voices[cmd.voice]) voices[cmd.voice]->set_gain(cmd.gain);
+        break;
+    }
+    publish_state();
+}
+
+// Ghi trạng thái voice trước khi render block sẽ được gửi thứ blocks_sent
+static void save_checkpoint() {
+    render_checkpoint_t &cp = checkpoints[blocks_sent % (QUEUE_SIZE + 1)];
+    cp.clock = sample_clock;
+    for (int v = 0; v < NUM_VOICES; v++) {
+        cp.position[v] = voices[v] ? voices[v]->position() : 0;
+        cp.active[v] = voice_active[v];
+        cp.gain[v] = voice_gain[v];
+    }
+    cp.log_index = command_log_count;
+}
+
+// Xả các block chưa phát trong audio_queue và quay đồng hồ mẫu cùng mọi voice về đầu block cũ nhất bị xả,
+// rồi đưa các lệnh đã áp dụng trong đoạn đó trở lại pending_commands tại đúng mẫu cũ. Engine render lại
+// đoạn đó y như trước - không voice nào bị nhảy cóc và timestamp vẫn khớp với những gì nghe thấy.
+// Audio đã vào OutputRouter và DMA vẫn được phát. Chỉ gọi ở đầu block. Trả về số frame đã quay lại.
+static int flush_render_queue(int16_t *scratch) {
+    // Không xả nếu command_log đã ghi đè lệnh cần phát lại hoặc pending_commands không đủ chỗ.
+    // Block cũ nhất chỉ có thể mới hơn khi i2s_output_task lấy thêm, nên kiểm tra trước khi xả là đủ.
+    int queued = uxQueueMessagesWaiting(audio_queue);
+    if (!queued) {
+        return 0;
+    }
+    uint32_t replay = command_log_count - checkpoints[(blocks_sent - queued) % (QUEUE_SIZE + 1)].log_index;
+    if (replay > COMMAND_LOG_SIZE || pending_count + replay > MAX_PENDING_COMMANDS) {
+        ESP_LOGW(TAG, "Too many commands to replay (%u), not flushing", (unsigned)replay);
+        return 0;
+    }
+    int flushed = 0;
+    // Lấy từng block thay vì xQueueReset để đếm chính xác khi i2s_output_task đang nhận song song
+    while (xQueueReceive(audio_queue, scratch, 0) == pdTRUE) {
+        flushed++;
+    }
+    if (!flushed) {
+        return 0;
+    }
+    blocks_sent -= flushed;
+    const render_checkpoint_t &cp = checkpoints[blocks_sent % (QUEUE_SIZE + 1)];
+    int frames = sample_clock - cp.clock;
+    sample_clock = cp.clock;
+    for (int v = 0; v < NUM_VOICES; v++) {
+        voice_active[v] = cp.active[v] && voices[v];
+        voice_gain[v] = cp.gain[v];
+        if (!voices[v]) continue;
+        voices[v]->set_gain(cp.gain[v]);
+        if (cp.active[v]) voices[v]->seek(cp.position[v]);
+    }
+    // Các lệnh phát lại đều sớm hơn mọi lệnh đang chờ nên đặt lên đầu, giữ nguyên thứ tự áp dụng
+    replay = command_log_count - cp.log_index;
+    memmove(&pending_commands[replay], &pending_commands[0], pending_count * sizeof(audio_command_t));
+    for (uint32_t i = 0; i < replay; i++) {
+        const logged_command_t &logged = command_log[(cp.log_index + i) & (COMMAND_LOG_SIZE - 1)];
+        pending_commands[i] = logged.cmd;
+        pending_commands[i].timestamp = logged.sample;
+        replayed_until = logged.sample;
+    }
+    pending_count += replay;
+    // Được ghi lại khi áp dụng lần nữa
+    command_log_count = cp.log_index;
+    publish_state();
+    return frames;
+}
+
+// Đặt lệnh từ nút bấm vào mẫu sẽ ra loa đúng INPUT_LATENCY_MS sau lúc nhấn. sample_clock là đồng hồ render,
+// đi trước loa bởi các block trong audio_queue và ring của OutputRouter, nên tính theo đồng hồ phát.
+// Nếu mẫu đó đã được render vào queue thì xả queue và render lại; độ trễ nhấn-nghe luôn bằng nhau
+// (cộng phần DMA I2S cố định), dù engine đang idle hay queue đang đầy.
+static void stamp_event_time(audio_command_t &cmd, int16_t *scratch) {
+    int64_t age_us = esp_timer_get_time() - cmd.received_us;
+    int buffered = uxQueueMessagesWaiting(audio_queue) * BUFFER_SIZE + output_router->buffered();
+    uint32_t playing = sample_clock - buffered;
+    uint32_t target = playing + ((int64_t)INPUT_LATENCY_MS * 1000 - age_us) * sample_rate / 1000000;
+    if ((int32_t)(target - sample_clock) < 0) {
+        flush_render_queue(scratch);
+    }
+    // Vẫn trễ hơn cả audio đã vào OutputRouter thì áp dụng ngay
+    cmd.timestamp = (int32_t)(target - sample_clock) > 0 ? target : 0;
+}
+
+static void schedule_command(audio_command_t cmd, int16_t *scratch) {
+    if (cmd.type == AUDIO_CMD_SEEK && !cmd.timestamp && voice_active[cmd.voice]) {
+        // Render lại các block chưa phát để vị trí mới được nghe sớm nhất có thể
+        flush_render_queue(scratch);
+    }
+    if (cmd.flags & AUDIO_CMD_FLAG_AT_EVENT_TIME) {
+        stamp_event_time(cmd, scratch);
+    } else if (!cmd.timestamp && (int32_t)(replayed_until - sample_clock) > 0) {
+        // Lệnh được gửi sau các lệnh đang phát lại nên áp dụng sau chúng (FIFO)
+        cmd.timestamp = replayed_until;
+    }
+    if (!cmd.timestamp || (int32_t)(cmd.timestamp - sample_clock) <= 0) {
+        apply_command(cmd, sample_clock);
+    } else if (pending_count < MAX_PENDING_COMMANDS) {
+        pending_commands[pending_count++] = cmd;
+    } else {
+        ESP_LOGW(TAG, "Too many pending commands, applying now");
+        apply_command(cmd, sample_clock);
     }
 }
 
-void IRAM_ATTR button_mix_isr_handler(void *arg) {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    xEventGroupSetBitsFromISR(event_group, BIT_BUTTON_MIX, &xHigherPriorityTaskWoken);
-    if (xHigherPriorityTaskWoken) {
-        portYIELD_FROM_ISR();
+// Áp dụng các lệnh đã tới hạn ở mẫu now, trả về số mẫu tới lệnh kế tiếp.
+// Mảng giữ thứ tự nhận lệnh, nên các lệnh cùng một mẫu chạy đúng thứ tự host gửi (FIFO).
+static int apply_due_commands(uint32_t now, int limit) {
+    int i = 0;
+    while (i < pending_count) {
+        int32_t delta = pending_commands[i].timestamp - now;
+        if (delta <= 0) {
+            apply_command(pending_commands[i], now);
+            // Dời các lệnh sau xuống thay vì đổi chỗ với lệnh cuối, tối đa MAX_PENDING_COMMANDS phần tử
+            pending_count--;
+            memmove(&pending_commands[i], &pending_commands[i + 1], (pending_count - i) * sizeof(audio_command_t));
+            continue;
+        }
+        if (delta < limit) limit = delta;
+        i++;
+    }
+    return limit;
+}
+
+// Render count frame từ các voice đang phát vào out
+static void render(int16_t *out, int16_t *main_buf, int16_t *mix_buf, int count) {
+    int main_samples = 0, mix_samples = 0;
+    bool ended = false;
+    if (voice_active[VOICE_MAIN]) {
+        main_samples = voices[VOICE_MAIN]->read(main_buf, count);
+        if (main_samples < count) {
+            voice_active[VOICE_MAIN] = false;
+            ended = true;
+        }
+    }
+    if (voice_active[VOICE_MIX]) {
+        mix_samples = voices[VOICE_MIX]->read(mix_buf, count);
+        if (mix_samples < count) {
+            voice_active[VOICE_MIX] = false;
+            ended = true;
+        }
+    }
+    memset(main_buf + main_samples * CHANNELS, 0, (count - main_samples) * CHANNELS * sizeof(int16_t));
+    memset(mix_buf + mix_samples * CHANNELS, 0, (count - mix_samples) * CHANNELS * sizeof(int16_t));
+    // Chỉ trộn phần cả hai voice cùng phát, phần còn lại lấy nguyên từ voice dài hơn
+    int both = main_samples < mix_samples ? main_samples : mix_samples;
+    int16_t *longer = main_samples >= mix_samples ? main_buf : mix_buf;
+    Mixer<CHANNELS>::mix(main_buf, mix_buf, out, both);
+    memcpy(out + both * CHANNELS, longer + both * CHANNELS, (count - both) * CHANNELS * sizeof(int16_t));
+    if (ended) {
+        publish_state();
     }
 }
 
-// Callback cho timer debounce
-void debounce_timer_callback(TimerHandle_t xTimer) {
-    // Không cần xử lý, chỉ dùng để đảm bảo debounce
-    // Không hiểu cái này lắmlắm
+// Callback cho UARTControl khi host hỏi trạng thái
+static void get_status(audio_status_t *status) {
+    status->active_voices = (voice_active[VOICE_MAIN] ? 1 : 0) | (voice_active[VOICE_MIX] ? 2 : 0);
+    status->queued_blocks = uxQueueMessagesWaiting(audio_queue);
+    status->free_commands = uxQueueSpacesAvailable(command_queue);
+    status->sample_clock = sample_clock;
+    status->max_latency_us = max_latency_us;
 }
 
-// Task đọc và mixing âm thanh
+// Task đọc và mixing âm thanh - chạy suốt, block trên command_queue khi engine ở chế độ idle
 void audio_processing_task(void *pvParameters) {
-    I2SOutput *output = new I2SOutput(I2S_NUM_0, i2s_speaker_pins);
-    int16_t *main_buf = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
-    int16_t *mix_buf = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
-    int16_t *output_buf = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    int16_t *main_buf = (int16_t *)malloc(BLOCK_SAMPLES * sizeof(int16_t));
+    int16_t *mix_buf = (int16_t *)malloc(BLOCK_SAMPLES * sizeof(int16_t));
+    int16_t *output_buf = (int16_t *)malloc(BLOCK_SAMPLES * sizeof(int16_t));
     if (!main_buf || !mix_buf || !output_buf) {
         ESP_LOGE(TAG, "Not enough memory for buffers");
-        delete output;
         vTaskDelete(NULL);
     }
 
-    FILE *main_fp = fopen("/sdcard/gong.wav", "rb");
-    FILE *mix_fp = fopen("/sdcard/huh.wav", "rb");
-    if (!main_fp || !mix_fp) {
-        ESP_LOGE(TAG, "Cannot open WAV files");
-        if (main_fp) fclose(main_fp);
-        if (mix_fp) fclose(mix_fp);
-        free(main_buf); free(mix_buf); free(output_buf);
-        delete output;
-        vTaskDelete(NULL);
-    }
-
-    WAVFileReader *main_reader = new WAVFileReader(main_fp);
-    WAVFileReader *mix_reader = new WAVFileReader(mix_fp);
+    // Mixer bắt đầu ở idle: không block nào được ghi ra I2S trước lệnh đầu tiên (driver chỉ được cài trong open_voices)
+    Mixer<CHANNELS> *mixer = new Mixer<CHANNELS>(SILENCE_HOLD_MS * (SAMPLE_RATE / 1000) / BUFFER_SIZE);
+    bool awake = true;
+    // Thời gian (us) của các block im lặng chưa được bù bằng vTaskDelayUntil
+    int64_t silence_us = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+    audio_command_t cmd;
 
-    ESP_LOGI(TAG, "Sample rate: %d", main_reader->sample_rate());
-    output->start(main_reader->sample_rate());
+    while (1) {
+        bool playing = voice_active[VOICE_MAIN] || voice_active[VOICE_MIX];
+        if (!playing && !pending_count && mixer->is_idle()) {
+            // Không có gì để phát: đóng file, block tới lệnh tiếp theo, DMA tự xóa (tx_desc_auto_clear)
+            ESP_LOGI(TAG, "Audio engine idle");
+            close_voices();
+            if (awake) {
+                engine_sleep();
+                awake = false;
+            }
+            xQueuePeek(command_queue, &cmd, portMAX_DELAY);
+            ESP_LOGI(TAG, "Audio engine waking up");
+            mixer->wake();
+            last_wake = xTaskGetTickCount();
+        }
 
-    while (xEventGroupGetBits(event_group) & BIT_MUSIC_PLAYING) {
-        if (xEventGroupGetBits(event_group) & BIT_STOP_REQUESTED) {
-            break;
+        while (xQueueReceive(command_queue, &cmd, 0) == pdTRUE) {
+            schedule_command(cmd, main_buf);
+        }
+        save_checkpoint();
+        // Chia block tại timestamp của các lệnh để áp dụng chính xác tới từng mẫu
+        int done = 0;
+        while (done < BUFFER_SIZE) {
+            int count = apply_due_commands(sample_clock + done, BUFFER_SIZE - done);
+            render(output_buf + done * CHANNELS, main_buf, mix_buf, count);
+            done += count;
         }
+        sample_clock += BUFFER_SIZE;
 
-        int main_samples = main_reader->read(main_buf, BUFFER_SIZE);
-        if (main_samples <= 0) break;
-
-        if (xEventGroupGetBits(event_group) & BIT_MIX_REQUESTED) {
-            int mix_samples = mix_reader->read(mix_buf, main_samples);
-            for (int i = 0; i < main_samples; i++) {
-                if (i < mix_samples) {
-                    int32_t mixed = (int32_t)main_buf[i] + (int32_t)mix_buf[i];
-                    output_buf[i] = (int16_t)(mixed / 2);
-                } else {
-                    output_buf[i] = main_buf[i];
-                }
+        if (!mixer->update(output_buf, BUFFER_SIZE)) {
+            if (!awake) {
+                engine_wake();
+                awake = true;
             }
-            if (mix_samples < main_samples) {
-                xEventGroupClearBits(event_group, BIT_MIX_REQUESTED);
-                fseek(mix_fp, 44, SEEK_SET);
+            silence_us = 0;
+            last_wake = xTaskGetTickCount();
+            // Chờ khi queue đầy để output router điều tốc (xQueueOverwrite chỉ dùng được với queue 1 phần tử)
+            if (xQueueSend(audio_queue, output_buf, portMAX_DELAY) != pdTRUE) {
+                ESP_LOGW(TAG, "Queue full, dropping block");
+            } else {
+                blocks_sent++;
             }
         } else {
-            memcpy(output_buf, main_buf, main_samples * sizeof(int16_t));
-        }
-
-        // Dùng xQueueOverwrite để ưu tiên dữ liệu mới nếu queue đầy
-        if (!xQueueOverwrite(audio_queue, output_buf)) {
-            ESP_LOGW(TAG, "Queue full, overwriting data");
+            // Đang phát đoạn im lặng: không gửi block nào, tự điều tốc theo thời gian thực
+            if (awake) {
+                // Các block còn trong audio_queue và ring của OutputRouter vẫn đang phát. Chờ chúng phát hết
+                // (đồng hồ mẫu đứng yên) rồi mới điều tốc, nếu không âm thanh sau đoạn im lặng vào queue rỗng
+                // và bị phát sớm đúng bằng độ sâu của queue.
+                int buffered = uxQueueMessagesWaiting(audio_queue) * BUFFER_SIZE + output_router->buffered();
+                int64_t drain_us = (int64_t)buffered * 1000000 / sample_rate;
+                TickType_t drain_ticks = drain_us / (portTICK_PERIOD_MS * 1000);
+                if (xQueuePeek(command_queue, &cmd, drain_ticks) == pdTRUE) {
+                    // Có lệnh khi queue chưa cạn: gửi luôn block im lặng này để block tiếp theo xếp ngay sau
+                    // phần còn lại trong queue, đúng thời điểm theo đồng hồ mẫu
+                    if (xQueueSend(audio_queue, output_buf, portMAX_DELAY) == pdTRUE) {
+                        blocks_sent++;
+                    }
+                    continue;
+                }
+                // Phần lẻ dưới một tick được bù bằng vTaskDelayUntil bên dưới
+                silence_us = drain_us - (int64_t)drain_ticks * portTICK_PERIOD_MS * 1000;
+                last_wake = xTaskGetTickCount();
+                engine_sleep();
+                awake = false;
+            }
+            silence_us += (int64_t)BUFFER_SIZE * 1000000 / sample_rate;
+            TickType_t ticks = silence_us / (portTICK_PERIOD_MS * 1000);
+            if (ticks > 0) {
+                silence_us -= (int64_t)ticks * portTICK_PERIOD_MS * 1000;
+                vTaskDelayUntil(&last_wake, ticks);
+            }
         }
     }
-
-    output->stop();
-    delete main_reader;
-    delete mix_reader;
-    fclose(main_fp);
-    fclose(mix_fp);
-    free(main_buf); free(mix_buf); free(output_buf);
-    delete output;
-    xEventGroupClearBits(event_group, BIT_MUSIC_PLAYING | BIT_STOP_REQUESTED);
-    vTaskDelete(NULL);
 }
 
-// Task phát âm thanh qua I2S
+// Task phát âm thanh qua tất cả các output - chỉ một thread ghi, mỗi output có buffer riêng.
+// Khi engine idle queue rỗng nên task này block trên xQueueReceive.
 void i2s_output_task(void *pvParameters) {
-    int16_t *buffer = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    int16_t *buffer = (int16_t *)malloc(BLOCK_SAMPLES * sizeof(int16_t));
     if (!buffer) {
         ESP_LOGE(TAG, "Not enough memory for buffer");
         vTaskDelete(NULL);
     }
 
-    while (xEventGroupGetBits(event_group) & BIT_MUSIC_PLAYING) {
+    while (1) {
         if (xQueueReceive(audio_queue, buffer, portMAX_DELAY) == pdTRUE) {
-            size_t bytes_written;
-            i2s_write(I2S_NUM_0, buffer, BUFFER_SIZE * sizeof(int16_t), &bytes_written, portMAX_DELAY);
-            if (bytes_written != BUFFER_SIZE * sizeof(int16_t)) {
-                ESP_LOGW(TAG, "Not all data written to I2S");
-            }
+            output_router->write(buffer, BUFFER_SIZE);
         }
     }
-    free(buffer);
-    vTaskDelete(NULL);
 }
 
-// Task xử lý nút bấm
-void button_task(void *pvParameters) {
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    while (1) {
-        EventBits_t bits = xEventGroupWaitBits(event_group, BIT_BUTTON_PLAY | BIT_BUTTON_MIX, pdTRUE, pdFALSE, portMAX_DELAY);
-        if (bits & BIT_BUTTON_PLAY) {
-            ESP_LOGI(TAG, "GPIO_BUTTON pressed");
-            if (xEventGroupGetBits(event_group) & BIT_MUSIC_PLAYING) {
-                ESP_LOGI(TAG, "Main music stopping");
-                xEventGroupSetBits(event_group, BIT_STOP_REQUESTED);
-            } else {
-                ESP_LOGI(TAG, "Main music starting");
-                xEventGroupSetBits(event_group, BIT_MUSIC_PLAYING);
-                xTaskCreate(audio_processing_task, "audio_processing_task", 4096, NULL, 5, NULL);
-                xTaskCreate(i2s_output_task, "i2s_output_task", 4096, NULL, 5, NULL);
-            }
-            xTimerStart(debounce_timer, 0); // Bắt đầu timer debounce
-        }
-        if (bits & BIT_BUTTON_MIX) {
-            ESP_LOGI(TAG, "GPIO_BUTTON_1 pressed - mix requested");
-            xEventGroupSetBits(event_group, BIT_MIX_REQUESTED);
-            xTimerStart(debounce_timer, 0);
-        }
-        // Dùng vTaskDelayUntil để kiểm soát tần suất
-        vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(10));
+// Handler của InputEvents - chạy trong ISR của timer debounce nên không log, không block.
+// Lệnh mang thời điểm nhấn thật để engine bù độ trễ.
+static void IRAM_ATTR input_event_handler(const input_event_t *event, void *arg, BaseType_t *woken) {
+    if (!event->pressed) {
+        return;
+    }
+    audio_command_t cmd = {};
+    EventBits_t bits = xEventGroupGetBitsFromISR(event_group);
+    switch (event->index) {
+    case INPUT_PLAY:
+        cmd.voice = VOICE_MAIN;
+        cmd.type = (bits & BIT_MUSIC_PLAYING) ? AUDIO_CMD_STOP : AUDIO_CMD_TRIGGER;
+        break;
+    case INPUT_MIX:
+        // Nhấn lần nữa để tắt mix - cần thiết khi file mix tự lặp
+        cmd.voice = VOICE_MIX;
+        cmd.type = (bits & BIT_MIX_REQUESTED) ? AUDIO_CMD_STOP : AUDIO_CMD_TRIGGER;
+        break;
+    default:
+        return;
     }
+    cmd.gain = GAIN_UNITY;
+    cmd.flags = AUDIO_CMD_FLAG_AT_EVENT_TIME;
+    cmd.received_us = event->time_us;
+    xQueueSendFromISR(command_queue, &cmd, woken);
 }
 
 void app_main(void) {
@@ -215,20 +517,42 @@ void app_main(void) {
         ESP_LOGE(TAG, "Cannot open /sdcard directory!");
     }
 
+    // Chuyển định dạng các file mới/thay đổi ở chế độ nền, engine dùng bản cache khi còn mới
+    asset_cache = new AssetCache("/sdcard", CACHE_DIR, SAMPLE_RATE, CHANNELS);
+
     // Khởi tạo FreeRTOS components
     event_group = xEventGroupCreate();
-    audio_queue = xQueueCreate(QUEUE_SIZE, BUFFER_SIZE * sizeof(int16_t));
-    debounce_timer = xTimerCreate("debounce_timer", pdMS_TO_TICKS(DEBOUNCE_TIME_MS), pdFALSE, NULL, debounce_timer_callback);
-
-    // Cấu hình GPIO cho nút bấm
-    gpio_set_direction(GPIO_BUTTON, GPIO_MODE_INPUT);
-    gpio_set_pull_mode(GPIO_BUTTON, GPIO_PULLDOWN_ONLY);
-    gpio_set_direction(GPIO_BUTTON_1, GPIO_MODE_INPUT);
-    gpio_set_pull_mode(GPIO_BUTTON_1, GPIO_PULLDOWN_ONLY);
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(GPIO_BUTTON, button_play_isr_handler, NULL);
-    gpio_isr_handler_add(GPIO_BUTTON_1, button_mix_isr_handler, NULL);
-
-    // Tạo task xử lý nút bấm
-    xTaskCreate(button_task, "button_task", 2048, NULL, 2, NULL);
+    audio_queue = xQueueCreate(QUEUE_SIZE, BLOCK_SAMPLES * sizeof(int16_t));
+    command_queue = xQueueCreate(COMMAND_QUEUE_SIZE, sizeof(audio_command_t));
+
+    // Các output nhận cùng một bản mix, output đầu tiên là clock master
+    output_router = new OutputRouter(BUFFER_SIZE, CHANNELS);
+    output_router->add_sink(new I2SOutput(I2S_SPEAKER_PORT, i2s_speaker_pins));
+#ifdef USE_DAC_OUTPUT
+    output_router->add_sink(new DACOutput(I2S_NUM_0));
+#endif
+
+#ifdef CONFIG_PM_ENABLE
+    // DFS: hạ xung CPU xuống 80MHz khi engine idle (driver I2S tự giữ APB ở mức tối đa)
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = 80,
+        .light_sleep_enable = false};
+    esp_pm_configure(&pm_config);
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "audio", &pm_lock);
+    esp_pm_lock_acquire(pm_lock);
+#endif
+
+    // Các task audio chạy suốt và tự block khi idle
+    xTaskCreate(audio_processing_task, "audio_processing_task", 4096, NULL, 5, NULL);
+    xTaskCreate(i2s_output_task, "i2s_output_task", 4096, NULL, 5, NULL);
+
+    // Nút bấm: ISR ghi thời điểm, timer phần cứng debounce, không cần task riêng.
+    // Thêm chân (ví dụ keypad) chỉ cần add_pin và một case trong input_event_handler.
+    InputEvents *inputs = new InputEvents(INPUT_DEBOUNCE_MS, input_event_handler);
+    inputs->add_pin(GPIO_BUTTON, true);
+    inputs->add_pin(GPIO_BUTTON_1, true);
+
+    // Nhận lệnh từ host controller qua UART
+    new UARTControl(CONTROL_UART_NUM, CONTROL_UART_TX, CONTROL_UART_RX, CONTROL_UART_BAUD, command_queue, get_status);
 }
\ No newline at end of file
@@ -0,0 +1,371 @@
+/**
+ * Host side harness for the UART control protocol.
+ *
+ *   ./control_harness              runs ControlParser behind a pseudo-terminal, checks
+ *                                  resync after noise and reports command-to-decode latency
+ *   ./control_harness /dev/ttyUSB0 talks to a board running the player and reports
+ *                                  STATUS round trip times and the board's own
+ *                                  command-to-apply latency
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "ControlParser.h"
+
+// commands sent for the latency measurement
+static const int LATENCY_COMMANDS = 2000;
+static const int REPLY_TIMEOUT_MS = 500;
+
+static int64_t now_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::vector<uint8_t> frame(uint8_t type, std::vector<uint8_t> payload)
+{
+  std::vector<uint8_t> bytes = {CONTROL_SYNC, type, (uint8_t)payload.size()};
+  for (uint8_t byte : payload)
+  {
+    bytes.push_back(byte);
+  }
+  uint8_t crc = 0;
+  for (size_t i = 1; i < bytes.size(); i++)
+  {
+    crc = ControlParser::crc8(crc, bytes[i]);
+  }
+  bytes.push_back(crc);
+  return bytes;
+}
+
+// GAIN carries a 16 bit value, used here as a sequence number to match replies to requests
+static std::vector<uint8_t> gain_frame(uint8_t voice, uint16_t gain)
+{
+  return frame(AUDIO_CMD_GAIN, {voice, (uint8_t)gain, (uint8_t)(gain >> 8)});
+}
+
+static bool write_all(int fd, const std::vector<uint8_t> &bytes)
+{
+  size_t done = 0;
+  while (done < bytes.size())
+  {
+    ssize_t written = write(fd, bytes.data() + done, bytes.size() - done);
+    if (written <= 0)
+    {
+      return false;
+    }
+    done += written;
+  }
+  return true;
+}
+
+static void make_raw(int fd, speed_t speed)
+{
+  termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void report(const char *name, std::vector<int64_t> samples)
+{
+  if (samples.empty())
+  {
+    printf("%s: no samples\n", name);
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  int64_t total = 0;
+  for (int64_t sample : samples)
+  {
+    total += sample;
+  }
+  printf("%s over %zu commands (us): min %lld  avg %lld  p50 %lld  p99 %lld  max %lld\n", name, samples.size(),
+         (long long)samples.front(), (long long)(total / (int64_t)samples.size()),
+         (long long)samples[samples.size() / 2], (long long)samples[samples.size() * 99 / 100],
+         (long long)samples.back());
+}
+
+/**
+ * Plays the device: decodes whatever arrives on the slave side of the pty
+ * and answers STATUS like UARTControl does
+ **/
+class Device
+{
+private:
+  int m_fd;
+  ControlParser m_parser;
+  std::atomic<bool> m_running{true};
+
+  void run()
+  {
+    uint8_t buffer[128];
+    while (m_running)
+    {
+      pollfd pfd = {m_fd, POLLIN, 0};
+      if (poll(&pfd, 1, 20) <= 0)
+      {
+        continue;
+      }
+      ssize_t count = read(m_fd, buffer, sizeof(buffer));
+      int64_t received = now_us();
+      for (ssize_t i = 0; i < count; i++)
+      {
+        m_parser.feed(buffer[i]);
+        audio_command_t command;
+        while (m_parser.next(command))
+        {
+          command.received_us = now_us() - received;
+          if (command.type == AUDIO_CMD_STATUS)
+          {
+            audio_status_t status = {};
+            uint8_t reply[CONTROL_STATUS_FRAME_SIZE];
+            write_all(m_fd, std::vector<uint8_t>(reply, reply + ControlParser::encode_status(status, reply)));
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          decoded.push_back(command);
+          decoded_at.push_back(now_us());
+        }
+      }
+    }
+  }
+
+public:
+  std::mutex mutex;
+  std::vector<audio_command_t> decoded;
+  std::vector<int64_t> decoded_at;
+
+private:
+  // started last, once everything it touches is constructed
+  std::thread m_thread;
+
+public:
+  Device(int fd) : m_fd(fd), m_thread(&Device::run, this) {}
+  ~Device()
+  {
+    m_running = false;
+    m_thread.join();
+  }
+  int errors() { return m_parser.errors(); }
+  size_t count()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return decoded.size();
+  }
+  bool wait_for(size_t count, int timeout_ms)
+  {
+    int64_t deadline = now_us() + timeout_ms * 1000;
+    while (this->count() < count)
+    {
+      if (now_us() > deadline)
+      {
+        return false;
+      }
+      usleep(50);
+    }
+    return true;
+  }
+};
+
+// send noise around valid frames and check exactly the valid frames come out
+static bool check_resync(int host, Device &device, const char *name, std::vector<uint8_t> bytes, std::vector<uint16_t> expected)
+{
+  size_t start = device.count();
+  write_all(host, bytes);
+  device.wait_for(start + expected.size(), REPLY_TIMEOUT_MS);
+  // give any extra (wrong) commands time to show up too
+  usleep(20000);
+  std::lock_guard<std::mutex> lock(device.mutex);
+  bool ok = device.decoded.size() - start == expected.size();
+  for (size_t i = 0; ok && i < expected.size(); i++)
+  {
+    ok = device.decoded[start + i].type == AUDIO_CMD_GAIN && device.decoded[start + i].gain == expected[i];
+  }
+  printf("  %-40s %s\n", name, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+static std::vector<uint8_t> join(std::initializer_list<std::vector<uint8_t>> parts)
+{
+  std::vector<uint8_t> bytes;
+  for (const auto &part : parts)
+  {
+    bytes.insert(bytes.end(), part.begin(), part.end());
+  }
+  return bytes;
+}
+
+static int run_loopback()
+{
+  int host, slave;
+  if (openpty(&host, &slave, NULL, NULL, NULL) != 0)
+  {
+    perror("openpty");
+    return 1;
+  }
+  make_raw(host, B921600);
+  make_raw(slave, B921600);
+  Device device(slave);
+  bool ok = true;
+
+  printf("Resync:\n");
+  std::vector<uint8_t> bad_crc = gain_frame(0, 2);
+  bad_crc.back() ^= 0xFF;
+  std::vector<uint8_t> cut = gain_frame(0, 3);
+  cut.resize(4);
+  ok &= check_resync(host, device, "clean frame", gain_frame(0, 1), {1});
+  ok &= check_resync(host, device, "stray sync before a frame", join({{CONTROL_SYNC}, gain_frame(1, 10)}), {10});
+  ok &= check_resync(host, device, "unknown type after sync", join({{CONTROL_SYNC, 0x42}, gain_frame(0, 11)}), {11});
+  ok &= check_resync(host, device, "bad crc then a frame", join({bad_crc, gain_frame(0, 12)}), {12});
+  ok &= check_resync(host, device, "bad length then a frame", join({{CONTROL_SYNC, AUDIO_CMD_GAIN, 0x09}, gain_frame(0, 13)}), {13});
+  ok &= check_resync(host, device, "truncated frame then a frame", join({cut, gain_frame(1, 14)}), {14});
+  ok &= check_resync(host, device, "frame inside a bad frame's payload",
+                     join({{CONTROL_SYNC, AUDIO_CMD_GAIN, 0x07}, gain_frame(0, 15), gain_frame(1, 16)}), {15, 16});
+  std::vector<uint8_t> noise(256);
+  srand(1);
+  for (auto &byte : noise)
+  {
+    byte = rand();
+  }
+  ok &= check_resync(host, device, "random noise then a frame", join({noise, {0x00, 0x00, 0x00, 0x00}, gain_frame(0, 17)}), {17});
+
+  // one command at a time so the figures are per command rather than per burst
+  printf("Latency:\n");
+  std::vector<int64_t> latency;
+  for (int i = 0; i < LATENCY_COMMANDS; i++)
+  {
+    size_t start = device.count();
+    int64_t sent = now_us();
+    write_all(host, gain_frame(0, 1000 + i));
+    if (!device.wait_for(start + 1, REPLY_TIMEOUT_MS))
+    {
+      printf("  command %d was not decoded\n", i);
+      ok = false;
+      break;
+    }
+    std::lock_guard<std::mutex> lock(device.mutex);
+    latency.push_back(device.decoded_at[start] - sent);
+  }
+  report("  send to decode", latency);
+
+  std::vector<int64_t> round_trip;
+  std::vector<uint8_t> status = frame(AUDIO_CMD_STATUS, {});
+  for (int i = 0; i < LATENCY_COMMANDS / 10; i++)
+  {
+    int64_t sent = now_us();
+    write_all(host, status);
+    uint8_t reply[CONTROL_STATUS_FRAME_SIZE];
+    int got = 0;
+    while (got < CONTROL_STATUS_FRAME_SIZE)
+    {
+      pollfd pfd = {host, POLLIN, 0};
+      if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+      {
+        break;
+      }
+      got += read(host, reply + got, sizeof(reply) - got);
+    }
+    if (got != CONTROL_STATUS_FRAME_SIZE)
+    {
+      printf("  no STATUS reply\n");
+      ok = false;
+      break;
+    }
+    round_trip.push_back(now_us() - sent);
+  }
+  report("  STATUS round trip", round_trip);
+  printf("Parser errors: %d\n", device.errors());
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  close(host);
+  return ok ? 0 : 1;
+}
+
+// read a STATUS reply from the board, returns false on timeout or a bad frame
+static bool read_status(int fd, audio_status_t &status)
+{
+  uint8_t reply[CONTROL_STATUS_FRAME_SIZE];
+  int got = 0;
+  while (got < CONTROL_STATUS_FRAME_SIZE)
+  {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+    {
+      return false;
+    }
+    ssize_t count = read(fd, reply + got, 1);
+    if (count <= 0 || (got == 0 && reply[0] != CONTROL_SYNC))
+    {
+      continue;
+    }
+    got += count;
+  }
+  uint8_t crc = 0;
+  for (int i = 1; i < CONTROL_STATUS_FRAME_SIZE - 1; i++)
+  {
+    crc = ControlParser::crc8(crc, reply[i]);
+  }
+  if (crc != reply[CONTROL_STATUS_FRAME_SIZE - 1] || reply[1] != (CONTROL_REPLY | AUDIO_CMD_STATUS))
+  {
+    return false;
+  }
+  status.active_voices = reply[3];
+  status.queued_blocks = reply[4];
+  status.free_commands = reply[5];
+  memcpy(&status.sample_clock, reply + 6, 4);
+  memcpy(&status.max_latency_us, reply + 10, 4);
+  return true;
+}
+
+static int run_device(const char *path)
+{
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0)
+  {
+    perror(path);
+    return 1;
+  }
+  make_raw(fd, B921600);
+  tcflush(fd, TCIOFLUSH);
+  // TRIGGER and STOP the mix voice so the board records command to apply latency
+  std::vector<int64_t> round_trip;
+  audio_status_t status = {};
+  for (int i = 0; i < LATENCY_COMMANDS / 10; i++)
+  {
+    write_all(fd, frame(i & 1 ? AUDIO_CMD_STOP : AUDIO_CMD_TRIGGER, {VOICE_MIX}));
+    int64_t sent = now_us();
+    write_all(fd, frame(AUDIO_CMD_STATUS, {}));
+    if (!read_status(fd, status))
+    {
+      printf("No STATUS reply from %s\n", path);
+      close(fd);
+      return 1;
+    }
+    round_trip.push_back(now_us() - sent);
+    usleep(20000);
+  }
+  write_all(fd, frame(AUDIO_CMD_STOP, {VOICE_MIX}));
+  report("STATUS round trip", round_trip);
+  printf("Board: worst command to apply latency %u us, sample clock %u, %d blocks queued\n",
+         status.max_latency_us, status.sample_clock, status.queued_blocks);
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  return argc > 1 ? run_device(argv[1]) : run_loopback();
+}